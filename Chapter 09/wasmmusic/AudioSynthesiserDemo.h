@@ -51,11 +51,9 @@
 #include "../Assets/DemoUtilities.h"
 #include "../Assets/AudioLiveScrollingDisplay.h"
 
-extern "C" void instrlib_init();
-extern "C" void instrlib_playEventsAndFillSampleBuffer();
-extern "C" void instrlib_fillsamplebuffer();
-extern "C" float32_t *instrlib_getSampleBuffer();
-extern "C" void instrlib_shortMessage(uint32_t d0, uint32_t d1, uint32_t d2);
+#include "instrlib.h"
+#include "lookahead.h"
+#include "rtlog.h"
 
 //==============================================================================
 /** Our demo synth sound is just a basic sine wave.. */
@@ -172,7 +170,12 @@ struct SynthAudioSource final : public AudioSource
 
         // ..and add a sound for them to play...
         setUsingSineWaveSound();
-        instrlib_init();
+        instrlib = instrlib_create(44100.0);
+    }
+
+    ~SynthAudioSource() override
+    {
+        instrlib_destroy(instrlib);
     }
 
     void setUsingSineWaveSound()
@@ -201,14 +204,25 @@ struct SynthAudioSource final : public AudioSource
                                         ));
     }
 
+    // plays the song compiled into the synth, live input is still rendered on top
+    void setPlayingSong(bool shouldPlay)
+    {
+        playingSong.store(shouldPlay, std::memory_order_relaxed);
+    }
+
     void prepareToPlay(int /*samplesPerBlockExpected*/, double sampleRate) override
     {
         midiCollector.reset(sampleRate);
 
         synth.setCurrentPlaybackSampleRate(sampleRate);
+
+        songPlayer.reset(new LookaheadPlayer((float)sampleRate, songLookaheadMillis));
     }
 
-    void releaseResources() override {}
+    void releaseResources() override
+    {
+        songPlayer.reset();
+    }
 
     void getNextAudioBlock(const AudioSourceChannelInfo &bufferToFill) override
     {
@@ -229,23 +243,35 @@ struct SynthAudioSource final : public AudioSource
         for (const auto metadata : incomingMidi) {
             MidiMessage message = metadata.getMessage();
             const uint8 * rawmessage = message.getRawData();
-            printf("%d, %d, %d\n",rawmessage[0], rawmessage[1], rawmessage[2]);
-            instrlib_shortMessage(rawmessage[0], rawmessage[1], rawmessage[2]);
+            rtlog.log("%d, %d, %d", rawmessage[0], rawmessage[1], rawmessage[2]);
+            instrlib_shortMessage(instrlib, rawmessage[0], rawmessage[1], rawmessage[2]);
         }
 
         AudioBuffer<float> &outputBuffer = *bufferToFill.buffer;
-        for (int sampleNo = 0; sampleNo < bufferToFill.numSamples; sampleNo += 128)
+        float *left = outputBuffer.getWritePointer(0, bufferToFill.startSample);
+        float *right = outputBuffer.getWritePointer(1, bufferToFill.startSample);
+        if (!incomingMidi.isEmpty())
         {
-            instrlib_fillsamplebuffer();
-        
-            float32_t * renderbuf = instrlib_getSampleBuffer();
-            
-            for (int ndx = 0; ndx < 128; ndx++)
+            liveInput = true;
+        }
+
+        if (songPlayer != nullptr && playingSong.load(std::memory_order_relaxed))
+        {
+            // the song was rendered ahead, so this is only a copy
+            if (songPlayer->read(left, right, bufferToFill.numSamples, 0.3f) < bufferToFill.numSamples)
+            {
+                rtlog.log("song lookahead underrun, %d underruns so far", (int)songPlayer->getNumUnderruns());
+            }
+            // live input cannot be rendered ahead, so it is rendered here once there has been any
+            if (liveInput)
             {
-                outputBuffer.addSample(0, sampleNo + ndx, renderbuf[ndx] * 0.3);
-                outputBuffer.addSample(1, sampleNo + ndx, renderbuf[ndx + 128] * 0.3);
+                instrlib_render(instrlib, left, right, bufferToFill.numSamples, 0.3f, true);
             }
         }
+        else
+        {
+            instrlib_render(instrlib, left, right, bufferToFill.numSamples, 0.3f, true);
+        }
         //synth.renderNextBlock (*bufferToFill.buffer, incomingMidi, 0, bufferToFill.numSamples);
     }
 
@@ -261,6 +287,18 @@ struct SynthAudioSource final : public AudioSource
 
     // the synth itself!
     Synthesiser synth;
+
+    // the wasm synth instance that renders the actual output
+    instrlib_t *instrlib = nullptr;
+
+    // song playback, rendered ahead on a worker thread
+    static constexpr double songLookaheadMillis = 200.0;
+    std::unique_ptr<LookaheadPlayer> songPlayer;
+    std::atomic<bool> playingSong{false};
+    bool liveInput = false;
+
+    // MIDI logging from the audio callback
+    RtLog rtlog{"SynthAudioSource"};
 };
 
 //==============================================================================
@@ -327,6 +365,10 @@ public:
         sampledButton.onClick = [this]
         { synthAudioSource.setUsingSampledSound(); };
 
+        addAndMakeVisible(songButton);
+        songButton.onClick = [this]
+        { synthAudioSource.setPlayingSong(songButton.getToggleState()); };
+
         addAndMakeVisible(liveAudioDisplayComp);
         audioSourcePlayer.setSource(&synthAudioSource);
 
@@ -359,6 +401,7 @@ public:
         keyboardComponent.setBounds(8, 96, getWidth() - 16, 64);
         sineButton.setBounds(16, 176, 150, 24);
         sampledButton.setBounds(16, 200, 150, 24);
+        songButton.setBounds(16, 224, 150, 24);
         liveAudioDisplayComp.setBounds(8, 8, getWidth() - 16, 64);
     }
 
@@ -377,6 +420,7 @@ private:
 
     ToggleButton sineButton{"Use sine wave"};
     ToggleButton sampledButton{"Use sampled sound"};
+    ToggleButton songButton{"Play song"};
 
     LiveScrollingAudioDisplay liveAudioDisplayComp;
 
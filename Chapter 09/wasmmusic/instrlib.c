@@ -1,49 +1,127 @@
 #include "./instruments.h"
+#include "./instrlib.h"
+#include "./mixkernels.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
 //#include <stdio.h>
 
 typedef struct w2c_environment {
     f32 SAMPLERATE;
 } w2c_environment;
 
-w2c_instruments instance;
-w2c_environment environment;
+#define QUANTUM_FRAMES 128
+
+struct instrlib {
+    w2c_instruments instance;
+    w2c_environment environment;
+    // frames at the end of the sample buffer that instrlib_render has not handed out yet
+    int bufferedFrames;
+};
+
+static pthread_once_t runtime_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool thread_initialized = false;
 
 f32* w2c_environment_SAMPLERATE(struct w2c_environment* environment) {
     return &environment->SAMPLERATE;
 }
 
-void instrlib_init() {
+static void runtime_init(void) {
+    // wasm_rt_init also sets up the thread that calls it
     wasm_rt_init();
-    environment.SAMPLERATE = 44100.0;
+    thread_initialized = true;
+}
 
-    wasm2c_instruments_instantiate(&instance, &environment);
+static inline void thread_enter(void) {
+    if (!thread_initialized) {
+        pthread_once(&runtime_once, runtime_init);
+        if (!thread_initialized) {
+            wasm_rt_init_thread();
+            thread_initialized = true;
+        }
+    }
 }
 
-void instrlib_fillsamplebuffer() {
-    w2c_instruments_fillSampleBuffer(&instance);
+void instrlib_thread_free(void) {
+    if (thread_initialized) {
+        wasm_rt_free_thread();
+        thread_initialized = false;
+    }
 }
 
-void instrlib_playEventsAndFillSampleBuffer() {
-    w2c_instruments_playEventsAndFillSampleBuffer(&instance);
+instrlib_t * instrlib_create(float samplerate) {
+    thread_enter();
+    instrlib_t * instrlib = calloc(1, sizeof(instrlib_t));
+    if (instrlib == NULL) {
+        return NULL;
+    }
+    instrlib->environment.SAMPLERATE = samplerate;
+
+    wasm2c_instruments_instantiate(&instrlib->instance, &instrlib->environment);
+    return instrlib;
+}
+
+void instrlib_destroy(instrlib_t * instrlib) {
+    if (instrlib == NULL) {
+        return;
+    }
+    wasm2c_instruments_free(&instrlib->instance);
+    free(instrlib);
 }
 
-f32 * instrlib_getSampleBuffer() {
-    wasm_rt_memory_t* memory = w2c_instruments_memory(&instance);
-    u32 * samplebufferaddr = w2c_instruments_samplebuffer(&instance);
-    return memory->data + *samplebufferaddr;
+void instrlib_fillsamplebuffer(instrlib_t * instrlib) {
+    thread_enter();
+    w2c_instruments_fillSampleBuffer(&instrlib->instance);
+}
+
+void instrlib_playEventsAndFillSampleBuffer(instrlib_t * instrlib) {
+    thread_enter();
+    w2c_instruments_playEventsAndFillSampleBuffer(&instrlib->instance);
+}
+
+f32 * instrlib_getSampleBuffer(instrlib_t * instrlib) {
+    wasm_rt_memory_t* memory = w2c_instruments_memory(&instrlib->instance);
+    u32 * samplebufferaddr = w2c_instruments_samplebuffer(&instrlib->instance);
+    return (f32 *)(memory->data + *samplebufferaddr);
+}
+
+void instrlib_render(instrlib_t * instrlib, float * left, float * right, int numFrames, float gain, bool accumulate) {
+    int pos = 0;
+    while (pos < numFrames) {
+        if (instrlib->bufferedFrames == 0) {
+            instrlib_fillsamplebuffer(instrlib);
+            instrlib->bufferedFrames = QUANTUM_FRAMES;
+        }
+        const float * renderbuf = instrlib_getSampleBuffer(instrlib) + QUANTUM_FRAMES - instrlib->bufferedFrames;
+        int count = numFrames - pos;
+        if (count > instrlib->bufferedFrames) {
+            count = instrlib->bufferedFrames;
+        }
+        if (accumulate) {
+            mix_accumulate_gain(left + pos, renderbuf, gain, count);
+            mix_accumulate_gain(right + pos, renderbuf + QUANTUM_FRAMES, gain, count);
+        } else {
+            mix_copy_gain(left + pos, renderbuf, gain, count);
+            mix_copy_gain(right + pos, renderbuf + QUANTUM_FRAMES, gain, count);
+        }
+        instrlib->bufferedFrames -= count;
+        pos += count;
+    }
 }
 
-void instrlib_shortMessage(u32 d0, u32 d1, u32 d2) {
-    w2c_instruments_shortmessage(&instance, d0, d1, d2);
+void instrlib_shortMessage(instrlib_t * instrlib, u32 d0, u32 d1, u32 d2) {
+    thread_enter();
+    w2c_instruments_shortmessage(&instrlib->instance, d0, d1, d2);
 }
 
 /*int main() {
-    instrlib_init();
+    instrlib_t * instrlib = instrlib_create(44100.0);
     for (int a = 0;a<1;a++) {
-        instrlib_playEventsAndFillSampleBuffer();
-        float * renderbuf = instrlib_getSampleBuffer();
+        instrlib_playEventsAndFillSampleBuffer(instrlib);
+        float * renderbuf = instrlib_getSampleBuffer(instrlib);
         for (int n=0;n<128;n++) {
             printf("%.10e\n", renderbuf[n]);
         }
     }
+    instrlib_destroy(instrlib);
 }*/
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef INSTRLIB_H
+#define INSTRLIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One instrlib_t owns one instance of the wasm2c converted synth and its own
+ * `environment` import. Separate handles can be rendered from separate
+ * threads, but one handle must only be used by one thread at a time.
+ */
+typedef struct instrlib instrlib_t;
+
+instrlib_t * instrlib_create(float samplerate);
+void instrlib_destroy(instrlib_t * instrlib);
+
+/* Releases the per thread wasm runtime state that is set up on first use. */
+void instrlib_thread_free(void);
+
+void instrlib_fillsamplebuffer(instrlib_t * instrlib);
+void instrlib_playEventsAndFillSampleBuffer(instrlib_t * instrlib);
+float * instrlib_getSampleBuffer(instrlib_t * instrlib);
+void instrlib_shortMessage(instrlib_t * instrlib, uint32_t d0, uint32_t d1, uint32_t d2);
+
+/*
+ * Renders numFrames of live output into planar host buffers, scaled by gain,
+ * overwriting them or adding to them (accumulate). The module always renders
+ * 128 frames, so frames left over from one call are handed out by the next.
+ * Do not mix this with instrlib_fillsamplebuffer on the same handle.
+ */
+void instrlib_render(instrlib_t * instrlib, float * left, float * right, int numFrames, float gain, bool accumulate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+#include "instrlib.h"
+#include "mixkernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/*
+ * Plays the song compiled into the synth from a ring buffer that a worker
+ * thread keeps filled lookaheadMillis ahead of playback. The song does not
+ * depend on live input, so all of its DSP can happen outside the audio
+ * callback, which only copies. The worker has its own synth instance.
+ *
+ * The ring is single producer (the worker), single consumer (the audio
+ * thread) and lock-free. The worker polls rather than being woken, so the
+ * audio thread never has to signal it.
+ */
+class LookaheadPlayer
+{
+public:
+    LookaheadPlayer(float samplerate, double lookaheadMillis)
+        : capacity(std::max(2, (int)(lookaheadMillis * samplerate / 1000.0 / quantumFrames) + 1) * quantumFrames),
+          left(capacity), right(capacity),
+          pollInterval(std::chrono::microseconds((int64_t)(capacity * 250000.0 / samplerate)))
+    {
+        instrlib = instrlib_create(samplerate);
+        // start with a full ring so the first callbacks do not underrun
+        fill();
+        worker = std::thread([this] { run(); });
+    }
+
+    ~LookaheadPlayer()
+    {
+        stopping.store(true, std::memory_order_relaxed);
+        worker.join();
+        instrlib_destroy(instrlib);
+    }
+
+    /*
+     * Audio thread: adds up to numFrames of the song, scaled by gain, to the
+     * buffers. Returns the number of frames that were ready, anything short of
+     * numFrames counts as an underrun and stays silent.
+     */
+    int read(float *outLeft, float *outRight, int numFrames, float gain) noexcept
+    {
+        const uint64_t readPosition = readFrame.load(std::memory_order_relaxed);
+        const uint64_t available = writeFrame.load(std::memory_order_acquire) - readPosition;
+        const int numRead = (int)std::min<uint64_t>(available, (uint64_t)numFrames);
+        if (numRead < numFrames)
+        {
+            underruns.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        const int offset = (int)(readPosition % capacity);
+        const int first = std::min(numRead, capacity - offset);
+        mix_accumulate_gain(outLeft, left.data() + offset, gain, first);
+        mix_accumulate_gain(outRight, right.data() + offset, gain, first);
+        mix_accumulate_gain(outLeft + first, left.data(), gain, numRead - first);
+        mix_accumulate_gain(outRight + first, right.data(), gain, numRead - first);
+
+        readFrame.store(readPosition + numRead, std::memory_order_release);
+        return numRead;
+    }
+
+    uint64_t getNumUnderruns() const noexcept
+    {
+        return underruns.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int quantumFrames = 128;
+
+    void fill()
+    {
+        uint64_t writePosition = writeFrame.load(std::memory_order_relaxed);
+        // the capacity is a whole number of quanta, so a quantum never wraps
+        while (writePosition + quantumFrames - readFrame.load(std::memory_order_acquire) <= (uint64_t)capacity)
+        {
+            instrlib_playEventsAndFillSampleBuffer(instrlib);
+            const float *renderbuf = instrlib_getSampleBuffer(instrlib);
+            const int offset = (int)(writePosition % capacity);
+            std::copy(renderbuf, renderbuf + quantumFrames, left.begin() + offset);
+            std::copy(renderbuf + quantumFrames, renderbuf + 2 * quantumFrames, right.begin() + offset);
+            writePosition += quantumFrames;
+            writeFrame.store(writePosition, std::memory_order_release);
+        }
+    }
+
+    void run()
+    {
+        while (!stopping.load(std::memory_order_relaxed))
+        {
+            fill();
+            std::this_thread::sleep_for(pollInterval);
+        }
+        instrlib_thread_free();
+    }
+
+    const int capacity;
+    std::vector<float> left;
+    std::vector<float> right;
+    // a quarter of the ring, so it is refilled well before it runs dry
+    const std::chrono::microseconds pollInterval;
+    instrlib_t *instrlib = nullptr;
+    std::atomic<uint64_t> writeFrame{0};
+    std::atomic<uint64_t> readFrame{0};
+    std::atomic<uint64_t> underruns{0};
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+};
+
+#endif
@@ -1,9 +1,182 @@
 #include <JuceHeader.h>
+#include "enginecache.h"
+#include "governor.h"
+#include "hotreload.h"
+#include "instrlib.h"
+#include "renderengine.h"
+#include "rtlog.h"
+#include "telemetry.h"
 
-extern "C" void instrlib_init(float samplerate);
-extern "C" void instrlib_fillsamplebufferwithnumsamples(int numsamples);
-extern "C" float *instrlib_getSampleBuffer();
-extern "C" void instrlib_shortMessage(uint32_t d0, uint32_t d1, uint32_t d2);
+#include <dlfcn.h>
+
+/* The instrlib functions WasmSynth calls, from the linked library or from a hot reloaded song */
+struct InstrlibFunctions
+{
+    decltype(&instrlib_create_with_memory) createWithMemory;
+    decltype(&instrlib_destroy) destroy;
+    decltype(&instrlib_reset) reset;
+    decltype(&instrlib_render) render;
+    decltype(&instrlib_shortMessage) shortMessage;
+    decltype(&instrlib_getTailLengthSeconds) getTailLengthSeconds;
+    decltype(&instrlib_getActiveVoices) getActiveVoices;
+    decltype(&renderengine_create_with_flags) createRenderEngine;
+    decltype(&renderengine_destroy) destroyRenderEngine;
+    decltype(&renderengine_getTrack) getTrack;
+    decltype(&renderengine_setTrackGainPan) setTrackGainPan;
+    decltype(&renderengine_render) renderTracks;
+    decltype(&renderengine_getNumRealtimeWorkers) getNumRealtimeWorkers;
+};
+
+static const InstrlibFunctions linkedInstrlib = {instrlib_create_with_memory, instrlib_destroy, instrlib_reset,
+                                                 instrlib_render, instrlib_shortMessage, instrlib_getTailLengthSeconds,
+                                                 instrlib_getActiveVoices, renderengine_create_with_flags,
+                                                 renderengine_destroy, renderengine_getTrack,
+                                                 renderengine_setTrackGainPan, renderengine_render,
+                                                 renderengine_getNumRealtimeWorkers};
+
+/*
+ * One instance of the song, or with numInstances above 1 a multitimbral engine:
+ * MIDI channel c plays on instance c % numInstances, and the instances render
+ * in parallel on the realtime workers of a renderengine, which the audio thread
+ * meets at a lock-free barrier every block and then sums their outputs.
+ * numThreads counts the audio thread, 0 is one per CPU. The workers take the
+ * audio thread's priority in the first block. If they could not, the audio
+ * thread renders the instances itself from then on, because it would spin on
+ * a worker that can be preempted.
+ */
+class InstrlibEngine
+{
+public:
+    InstrlibEngine(const InstrlibFunctions &functions, double sampleRate, int numInstances = 1, int numThreads = 0)
+        : functions(functions)
+    {
+        if (numInstances > 1)
+        {
+            tracks = functions.createRenderEngine(numInstances, numThreads, (float)sampleRate, maxTrackBlockFrames,
+                                                  RENDERENGINE_REALTIME);
+        }
+        if (tracks != nullptr)
+        {
+            for (int n = 0; n < numInstances; n++)
+            {
+                instances.push_back(functions.getTrack(tracks, n));
+            }
+        }
+        else
+        {
+            // the synth never grows beyond a few pages, so processBlock neither grows nor faults
+            instrlib_memory_options_t memoryOptions = {INSTRLIB_MEMORY_RESERVED, INSTRLIB_MEMORY_LOCKED, 64};
+            instances.push_back(functions.createWithMemory((float)sampleRate, &memoryOptions));
+        }
+        tailLengthSeconds = functions.getTailLengthSeconds((float)sampleRate);
+    }
+
+    ~InstrlibEngine()
+    {
+        if (tracks != nullptr)
+        {
+            // it owns the instances
+            functions.destroyRenderEngine(tracks);
+        }
+        else
+        {
+            functions.destroy(instances[0]);
+        }
+    }
+
+    /* Back to how it was created, without allocating, false if that was not possible */
+    bool reset()
+    {
+        for (instrlib_t *instance : instances)
+        {
+            if (!functions.reset(instance))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Whether this is an instance of the song in the library with these functions */
+    bool plays(const InstrlibFunctions &song) const
+    {
+        return functions.createWithMemory == song.createWithMemory;
+    }
+
+    void render(float *left, float *right, int numFrames, float gain, bool accumulate)
+    {
+        if (tracks == nullptr)
+        {
+            functions.render(instances[0], left, right, numFrames, gain, accumulate);
+            return;
+        }
+        // the renderengine writes its mix, WasmSynth never accumulates
+        jassert(!accumulate);
+        if (!renderInParallel)
+        {
+            for (int n = 0; n < (int)instances.size(); n++)
+            {
+                functions.render(instances[n], left, right, numFrames, gain, n > 0);
+            }
+            return;
+        }
+        if (gain != trackGain)
+        {
+            for (int n = 0; n < (int)instances.size(); n++)
+            {
+                functions.setTrackGainPan(tracks, n, gain, 0.0f);
+            }
+            trackGain = gain;
+        }
+        functions.renderTracks(tracks, left, right, numFrames);
+        if (!workersChecked)
+        {
+            renderInParallel = functions.getNumRealtimeWorkers(tracks) > 0;
+            workersChecked = true;
+        }
+    }
+
+    void shortMessage(uint32_t d0, uint32_t d1, uint32_t d2)
+    {
+        if (d0 < 0xf0)
+        {
+            functions.shortMessage(instances[(d0 & 0x0f) % instances.size()], d0, d1, d2);
+            return;
+        }
+        // system messages are for every instance
+        for (instrlib_t *instance : instances)
+        {
+            functions.shortMessage(instance, d0, d1, d2);
+        }
+    }
+
+    /* The voices of all instances, counting those that did not fit into voices */
+    int getActiveVoices(instrlib_voice_t *voices, int maxVoices)
+    {
+        int numVoices = 0;
+        for (instrlib_t *instance : instances)
+        {
+            numVoices += functions.getActiveVoices(instance, voices + jmin(numVoices, maxVoices), jmax(maxVoices - numVoices, 0));
+        }
+        return numVoices;
+    }
+
+    double getTailLengthSeconds() const { return tailLengthSeconds; }
+
+private:
+    // longer blocks are rendered in parts
+    static constexpr int maxTrackBlockFrames = 2048;
+
+    const InstrlibFunctions functions;
+    std::vector<instrlib_t *> instances;
+    renderengine_t *tracks = nullptr;
+    float trackGain = -1.0f;
+    // audio thread only
+    bool workersChecked = false;
+    bool renderInParallel = true;
+    double tailLengthSeconds;
+    JUCE_DECLARE_NON_COPYABLE(InstrlibEngine)
+};
 
 class WasmSynth final : public AudioProcessor
 {
@@ -13,55 +186,63 @@ public:
     {
     }
 
+    ~WasmSynth() override
+    {
+        delete fadingOut;
+    }
+
     static String getIdentifier()
     {
         return "Wasm Synth";
     }
 
-    void prepareToPlay(double newSampleRate, int) override
+    void prepareToPlay(double newSampleRate, int maximumExpectedSamplesPerBlock) override
     {
         synth.setCurrentPlaybackSampleRate(newSampleRate);
         printf("Samplerate is %f\n", newSampleRate);
-        instrlib_init((float)newSampleRate);
+        telemetry.prepare(newSampleRate);
+        governor.reset();
+        lastCallbackLoad = 0;
+        reloader.discardPending();
+        keepEngine();
+        preparedSampleRate = newSampleRate;
+        const InstrlibFunctions *reloaded = reloadedFunctions.load();
+        const InstrlibFunctions &functions = reloaded != nullptr ? *reloaded : linkedInstrlib;
+        // instances of a song that has been reloaded since are of no use any more
+        engineCache.retainIf([&functions](const InstrlibEngine &cached) { return cached.plays(functions); });
+        // switching to a samplerate that was played before is a pointer swap and a reset, not a new instance
+        engine = engineCache.take(newSampleRate);
+        if (engine == nullptr || !engine->reset())
+        {
+            engine = std::make_unique<InstrlibEngine>(functions, newSampleRate, numInstances, numThreads);
+        }
+        tailLengthSeconds = engine->getTailLengthSeconds();
+        fadeBuffer.setSize(2, jmax(maximumExpectedSamplesPerBlock, 128));
+        fadeLength = (int)(newSampleRate * 0.02);
         printf("Prepare complete");
     }
 
-    void releaseResources() override {}
+    void releaseResources() override
+    {
+        reloader.discardPending();
+        keepEngine();
+        preparedSampleRate = 0;
+    }
 
     void processBlock(AudioBuffer<float> &buffer, MidiBuffer &midiMessages) override
     {
-        for (const auto metadata : midiMessages)
-        {
-            MidiMessage message = metadata.getMessage();
-            const uint8 *rawmessage = message.getRawData();
-            printf("%d, %d, %d\n", rawmessage[0], rawmessage[1], rawmessage[2]);
-            instrlib_shortMessage(rawmessage[0], rawmessage[1], rawmessage[2]);
-        }
-
-        int numSamples = buffer.getNumSamples();
-        auto *left = buffer.getWritePointer(0);
-        auto *right = buffer.getWritePointer(1);
-
-        for (int sampleNo = 0; sampleNo < numSamples; sampleNo += 128)
-        {
-            int numSamplesToRender = numSamples - sampleNo;
-            if (numSamplesToRender > 128) {
-                numSamplesToRender = 128;
-            }
-            instrlib_fillsamplebufferwithnumsamples(numSamplesToRender);
-            float *renderbuf = instrlib_getSampleBuffer();
-            for (int ndx = 0; ndx < numSamplesToRender; ndx++)
-            {
-                left[sampleNo + ndx] = renderbuf[ndx] * 0.3;
-                right[sampleNo + ndx] = renderbuf[ndx + 128] * 0.3;
-            }
-        }
+        const auto callbackStart = RenderTelemetry::now();
+        renderBlock(buffer, midiMessages);
+        lastCallbackLoad = telemetry.callbackFinished(callbackStart, buffer.getNumSamples());
     }
 
     using AudioProcessor::processBlock;
 
+    /* Callback load, xruns and render times of this instance, for any thread to poll */
+    const RenderTelemetry &getTelemetry() const { return telemetry; }
+
     const String getName() const override { return getIdentifier(); }
-    double getTailLengthSeconds() const override { return 0.0; }
+    double getTailLengthSeconds() const override { return tailLengthSeconds; }
     bool acceptsMidi() const override { return true; }
     bool producesMidi() const override { return true; }
     AudioProcessorEditor *createEditor() override { return nullptr; }
@@ -75,7 +256,242 @@ public:
     void setStateInformation(const void *, int) override {}
 
 private:
+    void renderBlock(AudioBuffer<float> &buffer, MidiBuffer &midiMessages)
+    {
+        if (!engine)
+        {
+            buffer.clear();
+            return;
+        }
+        swapInReloadedEngine();
+        governVoices();
+
+        int numSamples = buffer.getNumSamples();
+        auto *left = buffer.getWritePointer(0);
+        auto *right = buffer.getWritePointer(1);
+
+        if (midiMessages.isEmpty())
+        {
+            render(left, right, numSamples);
+            return;
+        }
+
+        // render up to each event so that it takes effect on its own frame
+        int position = 0;
+        for (const auto metadata : midiMessages)
+        {
+            int eventPosition = jlimit(position, numSamples, metadata.samplePosition);
+            render(left + position, right + position, eventPosition - position);
+            position = eventPosition;
+
+            MidiMessage message = metadata.getMessage();
+            const uint8 *rawmessage = message.getRawData();
+            rtlog.log("%d, %d, %d", rawmessage[0], rawmessage[1], rawmessage[2]);
+            engine->shortMessage(rawmessage[0], rawmessage[1], rawmessage[2]);
+            if (fadingOut != nullptr)
+            {
+                // so that its note offs arrive while it fades out
+                fadingOut->shortMessage(rawmessage[0], rawmessage[1], rawmessage[2]);
+            }
+            heldNotes.update(rawmessage);
+            governor.noteEvent(rawmessage);
+        }
+        render(left + position, right + position, numSamples - position);
+    }
+
+    void render(float *left, float *right, int numFrames)
+    {
+        const auto renderStart = RenderTelemetry::now();
+        engine->render(left, right, numFrames, 0.3f, false);
+        telemetry.renderFinished(renderStart, numFrames);
+        if (fadingOut == nullptr || fadePosition >= fadeLength)
+        {
+            return;
+        }
+        for (int frame = 0; frame < numFrames && fadePosition < fadeLength;)
+        {
+            int numFramesToFade = jmin(numFrames - frame, fadeLength - fadePosition, fadeBuffer.getNumSamples());
+            float *fadeLeft = fadeBuffer.getWritePointer(0);
+            float *fadeRight = fadeBuffer.getWritePointer(1);
+            fadingOut->render(fadeLeft, fadeRight, numFramesToFade, 0.3f, false);
+            crossfade(left + frame, fadeLeft, numFramesToFade, fadePosition, fadeLength);
+            crossfade(right + frame, fadeRight, numFramesToFade, fadePosition, fadeLength);
+            frame += numFramesToFade;
+            fadePosition += numFramesToFade;
+        }
+    }
+
+    /* Audio thread: lets the governor shed voices if the last callback came too close to its deadline */
+    void governVoices()
+    {
+        const int numStolen = governor.update(
+            lastCallbackLoad, [this](instrlib_voice_t *voices, int maxVoices) { return engine->getActiveVoices(voices, maxVoices); },
+            [this](uint8 status, uint8 note, uint8 velocity)
+            {
+                engine->shortMessage(status, note, velocity);
+                // a reloaded engine must not get the note back
+                const uint8 noteOff[3] = {status, note, velocity};
+                heldNotes.update(noteOff);
+            });
+        telemetry.voicesStolen(numStolen);
+    }
+
+    static PolyphonyGovernor<instrlib_voice_t>::Policy getStealPolicy()
+    {
+        return SystemStats::getEnvironmentVariable("WASMSYNTH_VOICE_STEALING", "oldest") == "quietest"
+                   ? PolyphonyGovernor<instrlib_voice_t>::quietest
+                   : PolyphonyGovernor<instrlib_voice_t>::oldest;
+    }
+
+    void swapInReloadedEngine()
+    {
+        if (fadingOut != nullptr)
+        {
+            // the watcher thread deletes it, the next block tries again if it is still busy
+            if (fadePosition < fadeLength || !reloader.retire(fadingOut))
+            {
+                return;
+            }
+            fadingOut = nullptr;
+        }
+        InstrlibEngine *reloaded = reloader.takeReloaded();
+        if (reloaded == nullptr)
+        {
+            return;
+        }
+        // the load and the limit were the old engine's, the held notes start over as the new one's
+        governor.reset();
+        heldNotes.forEach([this, reloaded](uint8 status, uint8 note, uint8 velocity)
+                          {
+                              reloaded->shortMessage(status, note, velocity);
+                              const uint8 noteOn[3] = {status, note, velocity};
+                              governor.noteEvent(noteOn);
+                          });
+        fadingOut = engine.release();
+        engine.reset(reloaded);
+        fadePosition = 0;
+        tailLengthSeconds = engine->getTailLengthSeconds();
+        rtlog.log("crossfading to the reloaded song");
+    }
+
+    /* Watcher thread: converts the song with songlib.sh and loads the library */
+    std::unique_ptr<InstrlibEngine> buildReloadedEngine()
+    {
+        const double sampleRate = preparedSampleRate;
+        const InstrlibFunctions *functions = loadSongLibrary();
+        if (functions == nullptr)
+        {
+            return nullptr;
+        }
+        // later prepareToPlay calls instantiate this song too
+        reloadedFunctions = functions;
+        if (sampleRate == 0)
+        {
+            return nullptr;
+        }
+        return std::make_unique<InstrlibEngine>(*functions, sampleRate, numInstances, numThreads);
+    }
+
+    const InstrlibFunctions *loadSongLibrary()
+    {
+        File library = File::createTempFile(".so");
+        ChildProcess songlib;
+        if (!songlib.start(StringArray{"/bin/bash", songlibScript, songFile.getFullPathName(), library.getFullPathName()}))
+        {
+            printf("Could not run %s\n", songlibScript.toRawUTF8());
+            return nullptr;
+        }
+        String output = songlib.readAllProcessOutput();
+        songlib.waitForProcessToFinish(-1);
+        if (songlib.getExitCode() != 0)
+        {
+            printf("Converting %s failed:\n%s\n", songFile.getFullPathName().toRawUTF8(), output.toRawUTF8());
+            library.deleteFile();
+            return nullptr;
+        }
+
+        // never closed: the wasm2c runtime in it has thread locals, it is bounds checked so it has no signal handler
+        void *handle = dlopen(library.getFullPathName().toRawUTF8(), RTLD_NOW | RTLD_LOCAL);
+        library.deleteFile();
+        if (handle == nullptr)
+        {
+            printf("%s\n", dlerror());
+            return nullptr;
+        }
+        auto functions = std::make_unique<InstrlibFunctions>();
+        bool found = lookup(handle, "instrlib_create_with_memory", functions->createWithMemory)
+                     && lookup(handle, "instrlib_destroy", functions->destroy)
+                     && lookup(handle, "instrlib_reset", functions->reset)
+                     && lookup(handle, "instrlib_render", functions->render)
+                     && lookup(handle, "instrlib_shortMessage", functions->shortMessage)
+                     && lookup(handle, "instrlib_getTailLengthSeconds", functions->getTailLengthSeconds)
+                     && lookup(handle, "instrlib_getActiveVoices", functions->getActiveVoices)
+                     && lookup(handle, "renderengine_create_with_flags", functions->createRenderEngine)
+                     && lookup(handle, "renderengine_destroy", functions->destroyRenderEngine)
+                     && lookup(handle, "renderengine_getTrack", functions->getTrack)
+                     && lookup(handle, "renderengine_setTrackGainPan", functions->setTrackGainPan)
+                     && lookup(handle, "renderengine_render", functions->renderTracks)
+                     && lookup(handle, "renderengine_getNumRealtimeWorkers", functions->getNumRealtimeWorkers);
+        if (!found)
+        {
+            printf("%s is not an instrlib library\n", songlibScript.toRawUTF8());
+            return nullptr;
+        }
+        printf("Loaded the new %s\n", songFile.getFullPathName().toRawUTF8());
+        loadedLibraries.push_back(std::move(functions));
+        return loadedLibraries.back().get();
+    }
+
+    template <typename Function>
+    static bool lookup(void *handle, const char *symbol, Function &function)
+    {
+        function = reinterpret_cast<Function>(dlsym(handle, symbol));
+        return function != nullptr;
+    }
+
+    /* Not on the audio thread: moves the engine into the cache for the samplerate it was prepared for */
+    void keepEngine()
+    {
+        engineCache.put(preparedSampleRate, std::move(engine));
+        delete fadingOut;
+        fadingOut = nullptr;
+        heldNotes.clear();
+    }
+
+    const File songFile = File::getSpecialLocation(File::userHomeDirectory).getChildFile("song.wasm");
+    // hot reloading converts ~/song.wasm with songlib.sh, it is off unless WASMSYNTH_SONGLIB names the script
+    const String songlibScript = SystemStats::getEnvironmentVariable("WASMSYNTH_SONGLIB", {});
+    // WASMSYNTH_MULTITIMBRAL=n plays the 16 channels on n instances in parallel, on WASMSYNTH_THREADS threads
+    // (the audio thread included, one per CPU by default). More than 16 would leave instances without a channel
+    const int numInstances = jlimit(1, 16, SystemStats::getEnvironmentVariable("WASMSYNTH_MULTITIMBRAL", "1").getIntValue());
+    const int numThreads = SystemStats::getEnvironmentVariable("WASMSYNTH_THREADS", "0").getIntValue();
+    std::atomic<double> preparedSampleRate{0};
+    std::atomic<double> tailLengthSeconds{0.0};
+
+    // enough for 44.1, 48, 88.2 and 96 kHz
+    EngineCache<InstrlibEngine> engineCache{4};
+    std::unique_ptr<InstrlibEngine> engine;
+    InstrlibEngine *fadingOut = nullptr;
+    AudioBuffer<float> fadeBuffer;
+    int fadePosition = 0;
+    int fadeLength = 0;
+    HeldNotes heldNotes;
+
+    // the function tables of every library loaded by the watcher thread, the latest in reloadedFunctions
+    std::vector<std::unique_ptr<InstrlibFunctions>> loadedLibraries;
+    std::atomic<const InstrlibFunctions *> reloadedFunctions{nullptr};
+
+    RtLog rtlog{"WasmSynth"};
+    // appended to the file WASMSYNTH_TELEMETRY names every 10 seconds
+    RenderTelemetry telemetry{"WasmSynth", SystemStats::getEnvironmentVariable("WASMSYNTH_TELEMETRY", {}).toStdString()};
+    // voices are stolen past WASMSYNTH_VOICE_BUDGET (0.75 of the deadline by default, 0 turns it off),
+    // the oldest first or with WASMSYNTH_VOICE_STEALING=quietest the quietest
+    PolyphonyGovernor<instrlib_voice_t> governor{SystemStats::getEnvironmentVariable("WASMSYNTH_VOICE_BUDGET", "0.75").getDoubleValue(),
+                                                 getStealPolicy()};
+    double lastCallbackLoad = 0;
     Synthesiser synth;
+    // last, so that the watcher thread stops before anything it uses is destroyed
+    HotReloader<InstrlibEngine> reloader{songFile, songlibScript.isNotEmpty(), [this] { return buildReloadedEngine(); }};
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmSynth)
 };
 
@@ -1,5 +1,43 @@
 #!/bin/bash
 WASM2C=/opt/homebrew/Cellar/wabt/1.0.34/share/wabt/wasm2c   
-clang -O3 -I$WASM2C -I/opt/homebrew/include instruments.c $WASM2C/wasm-rt-impl.c instrlib.c -c
-ar -rcs libinstrlib.a instruments.o instrlib.o wasm-rt-impl.o
+# linear memory is bounds checked with guard pages, instrlib_memory.c replaces the runtime's allocator
+MEMCHECK=-DWASM_RT_MEMCHECK_GUARD_PAGES=1
+RTRENAME="-Dwasm_rt_allocate_memory=wasm_rt_impl_allocate_memory -Dwasm_rt_grow_memory=wasm_rt_impl_grow_memory -Dwasm_rt_free_memory=wasm_rt_impl_free_memory"
+clang -O3 -I$WASM2C $MEMCHECK $RTRENAME $WASM2C/wasm-rt-impl.c -c
+clang -O3 -I$WASM2C -I/opt/homebrew/include $MEMCHECK instruments.c instrlib.c instrlib_memory.c instrlib_template.c renderengine.c seekindex.c -c
+ar -rcs libinstrlib.a instruments.o instrlib.o instrlib_memory.o instrlib_template.o renderengine.o seekindex.o wasm-rt-impl.o
+clang -O3 songrender.c libinstrlib.a -lm -lpthread -o songrender
+clang -O3 membench.c libinstrlib.a -lm -lpthread -o membench
+clang -O3 onsetcheck.c libinstrlib.a -lm -lpthread -o onsetcheck && ./onsetcheck
+clang++ -std=c++17 -O3 governorcheck.cpp -o governorcheck && ./governorcheck
+clang -O3 seekcheck.c libinstrlib.a -lm -lpthread -o seekcheck && ./seekcheck
+clang -O3 -I$WASM2C startbench.c libinstrlib.a -lm -lpthread -o startbench
+clang -O3 mtbench.c libinstrlib.a -lm -lpthread -o mtbench
+# the same benchmark with explicit bounds checks instead of guard pages, for comparison
+BOUNDSCHECK=-DWASM_RT_MEMCHECK_BOUNDS_CHECK=1
+mkdir -p boundscheck
+(cd boundscheck && clang -O3 -I$WASM2C $BOUNDSCHECK $RTRENAME $WASM2C/wasm-rt-impl.c -c && clang -O3 -I$WASM2C -I/opt/homebrew/include $BOUNDSCHECK ../instruments.c ../instrlib.c ../instrlib_memory.c ../instrlib_template.c -c)
+clang -O3 membench.c boundscheck/*.o -lm -lpthread -o membench_boundscheck
+# scalar and SIMD128 builds of the song as shared libraries for simdbench, when the song has been
+# exported with SIMD128 as song_simd.wasm. wasm2c translates SIMD128 to SIMDe (in /opt/homebrew/include),
+# which uses SSE4.2 on x86-64 and NEON on arm64. Both builds get the same flags so only the module differs.
+# Each library carries its own wasm2c runtime, and with guard pages each would install the process wide SIGSEGV
+# handler, so that a trap in one build longjmps through the other runtime's jump buffer. They are bounds checked
+# instead: a trap goes through wasm_rt_trap of the library it happened in, and no signal handler is installed
+if [ -f song_simd.wasm ]; then
+    SIMDFLAGS=$([ "$(uname -m)" = x86_64 ] && echo -msse4.2)
+    mkdir -p simd
+    wasm2c song_simd.wasm -n instruments -o simd/instruments.c
+    cp instrlib.c instrlib.h instrlib_internal.h instrlib_memory.c instrlib_template.c mixkernels.h simd/
+    (cd simd && clang -O3 -fPIC $SIMDFLAGS -I$WASM2C $BOUNDSCHECK $RTRENAME $WASM2C/wasm-rt-impl.c -c && clang -O3 -fPIC -shared $SIMDFLAGS -I$WASM2C -I/opt/homebrew/include $BOUNDSCHECK instruments.c instrlib.c instrlib_memory.c instrlib_template.c wasm-rt-impl.o -lm -lpthread -o libinstrlib_simd.so)
+    clang -O3 -fPIC -shared $SIMDFLAGS -I$WASM2C -I/opt/homebrew/include $BOUNDSCHECK instruments.c instrlib.c instrlib_memory.c instrlib_template.c simd/wasm-rt-impl.o -lm -lpthread -o libinstrlib_scalar.so
+    clang -O3 simdbench.c -lm -ldl -o simdbench
+fi
+# per function profile of the synth, see instrprof.h. Only the module's own functions are instrumented,
+# after wasm2c's inline helpers are inlined into them
+PROFILE="-finstrument-functions-after-inlining -finline-hint-functions"
+mkdir -p profile
+grep -o 'w2c_instruments_[A-Za-z0-9_]*(w2c_instruments\*' instruments.c | sort -u | sed 's/w2c_instruments_\(.*\)(.*/INSTRPROF_SYMBOL(\1)/' > profile/instrprof_symbols.h
+(cd profile && clang -O3 -I$WASM2C -I. $MEMCHECK $PROFILE ../instrprof_symbols.c -c && clang -O3 -I$WASM2C -I/opt/homebrew/include $MEMCHECK ../instrprof.c ../instrlib.c ../instrlib_memory.c ../instrlib_template.c ../renderengine.c ../seekindex.c -c && ar -rcs libinstrlib_profile.a *.o ../wasm-rt-impl.o)
+clang -O3 songrender.c profile/libinstrlib_profile.a -lm -lpthread -o songrender_profile
 (cd build && cmake .. && cmake --build .)
\ No newline at end of file
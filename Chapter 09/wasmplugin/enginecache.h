@@ -0,0 +1,90 @@
+#ifndef ENGINECACHE_H
+#define ENGINECACHE_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/*
+ * Engines kept per samplerate while the host plays at another one, so that
+ * prepareToPlay switching back to a samplerate takes the engine that is
+ * already instantiated for it instead of creating a new one.
+ *
+ * At most capacity engines are kept, when the cache is full put deletes the
+ * one that was used longest ago. Engines are only ever deleted inside put,
+ * retainIf, clear and the destructor, on the thread that calls them, which is
+ * prepareToPlay's and never the audio thread.
+ */
+template <typename Engine>
+class EngineCache
+{
+public:
+    explicit EngineCache(size_t capacity)
+        : capacity(capacity)
+    {
+        entries.reserve(capacity);
+    }
+
+    /* The engine kept for sampleRate, which the caller now owns, or nullptr */
+    std::unique_ptr<Engine> take(double sampleRate)
+    {
+        for (auto entry = entries.begin(); entry != entries.end(); ++entry)
+        {
+            if (entry->sampleRate == sampleRate)
+            {
+                std::unique_ptr<Engine> engine = std::move(entry->engine);
+                entries.erase(entry);
+                return engine;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Keeps engine for sampleRate, deleting the one that was kept for it before */
+    void put(double sampleRate, std::unique_ptr<Engine> engine)
+    {
+        take(sampleRate);
+        if (engine == nullptr || capacity == 0)
+        {
+            return;
+        }
+        if (entries.size() == capacity)
+        {
+            entries.erase(entries.begin());
+        }
+        entries.push_back({sampleRate, std::move(engine)});
+    }
+
+    /* Deletes the engines keep returns false for, e.g. those of a song that has been reloaded since */
+    template <typename Keep>
+    void retainIf(Keep keep)
+    {
+        for (auto entry = entries.begin(); entry != entries.end();)
+        {
+            entry = keep(*entry->engine) ? entry + 1 : entries.erase(entry);
+        }
+    }
+
+    void clear()
+    {
+        entries.clear();
+    }
+
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry
+    {
+        double sampleRate;
+        std::unique_ptr<Engine> engine;
+    };
+
+    const size_t capacity;
+    // least recently used first
+    std::vector<Entry> entries;
+
+    EngineCache(const EngineCache &) = delete;
+    EngineCache &operator=(const EngineCache &) = delete;
+};
+
+#endif
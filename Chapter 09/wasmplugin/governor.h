@@ -0,0 +1,189 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Sheds voices when the synth gets close to missing its deadline, so that a
+ * dense passage loses notes instead of dropping out.
+ *
+ * The governor follows the callback load (callback time / deadline, from
+ * RenderTelemetry). The load it acts on rises with the measurements at once
+ * and falls back slowly. Above the budget it lowers a voice limit, below the
+ * release level (budget * (1 - hysteresis)) it raises it again, and in between
+ * it keeps it, so that it does not steal a voice, recover and steal again in a
+ * loop. The limit only moves every few callbacks, to give the synth time to
+ * show what the last change did. It is only lowered while more than one voice
+ * is held: when the load comes from release tails or from the engine's own
+ * fixed cost, stealing held notes would not bring it down.
+ *
+ * The limit is on held voices, the ones in getActiveVoicesStatusSnapshot whose
+ * note is still down: voices that are already releasing can not be stolen with
+ * a note off, and a stolen voice keeps playing its release for a while. When
+ * more voices are held than the limit allows, the governor steals the oldest,
+ * or the quietest by velocity, with note offs through shortmessage.
+ *
+ * Voice is the engine's voice record, with channel, note and velocity. Only
+ * the audio thread uses a governor, it does not lock or allocate.
+ */
+template <typename Voice>
+class PolyphonyGovernor
+{
+public:
+    enum Policy
+    {
+        oldest,
+        quietest
+    };
+
+    static constexpr int maxVoices = 128;
+
+    /* A budget of 0 turns the governor off */
+    PolyphonyGovernor(double budget, Policy policy, double hysteresis = 0.25)
+        : budget(budget), releaseLevel(budget * (1 - hysteresis)), policy(policy)
+    {
+    }
+
+    /* Forgets the load, the limit and the held notes, for a new engine or samplerate */
+    void reset() noexcept
+    {
+        smoothedLoad = 0;
+        voiceLimit = unlimited;
+        callbacksUntilAdjust = 0;
+        std::memset(noteOnTimes, 0, sizeof(noteOnTimes));
+        clock = 0;
+    }
+
+    /* Every MIDI message that goes to the engine, so that the governor knows how old each note is */
+    void noteEvent(const uint8_t *rawmessage) noexcept
+    {
+        const int channel = rawmessage[0] & 0x0f;
+        const int note = rawmessage[1] & 0x7f;
+        switch (rawmessage[0] & 0xf0)
+        {
+        case 0x90:
+            noteOnTimes[channel][note] = rawmessage[2] != 0 ? ++clock : 0;
+            break;
+        case 0x80:
+            noteOnTimes[channel][note] = 0;
+            break;
+        case 0xb0:
+            // all sound off and all notes off
+            if (rawmessage[1] == 120 || rawmessage[1] == 123)
+            {
+                std::memset(noteOnTimes[channel], 0, sizeof(noteOnTimes[channel]));
+            }
+            break;
+        }
+    }
+
+    /*
+     * Once per callback with the load of the previous one. getVoices is
+     * int(Voice *voices, int maxVoices) like SynthEngine::getActiveVoices and
+     * is only called while there is a limit. steal(status, note, velocity)
+     * sends a note off. Returns the number of voices stolen.
+     */
+    template <typename GetVoices, typename Steal>
+    int update(double load, GetVoices getVoices, Steal steal) noexcept
+    {
+        if (budget <= 0)
+        {
+            return 0;
+        }
+        // at once when it rises, over about 20 callbacks when it falls
+        smoothedLoad = load > smoothedLoad ? load : smoothedLoad + (load - smoothedLoad) * 0.05;
+        if (callbacksUntilAdjust > 0)
+        {
+            callbacksUntilAdjust--;
+        }
+        if (voiceLimit == unlimited && smoothedLoad <= budget)
+        {
+            return 0;
+        }
+
+        const int numActive = std::min(getVoices(voices, maxVoices), maxVoices);
+        int numHeld = 0;
+        for (int n = 0; n < numActive; n++)
+        {
+            if (getNoteOnTime(voices[n]) != 0)
+            {
+                voices[numHeld++] = voices[n];
+            }
+        }
+        if (callbacksUntilAdjust == 0)
+        {
+            if (smoothedLoad > budget && numHeld > 1)
+            {
+                voiceLimit = std::max(std::min(voiceLimit, numHeld) - 1, 1);
+                callbacksUntilAdjust = adjustInterval;
+            }
+            else if (smoothedLoad < releaseLevel)
+            {
+                voiceLimit += std::max(voiceLimit / 4, 1);
+                voiceLimit = voiceLimit >= maxVoices ? unlimited : voiceLimit;
+                callbacksUntilAdjust = adjustInterval;
+            }
+        }
+
+        int numStolen = 0;
+        while (numHeld > voiceLimit)
+        {
+            const int victim = pickVictim(numHeld);
+            const Voice &voice = voices[victim];
+            steal((uint8_t)(0x80 | (voice.channel & 0x0f)), voice.note, (uint8_t)0);
+            // the same note may be in the snapshot twice, once releasing
+            getNoteOnTime(voice) = 0;
+            voices[victim] = voices[--numHeld];
+            numStolen++;
+        }
+        return numStolen;
+    }
+
+    /* The voice limit in effect, maxVoices when there is none */
+    int getVoiceLimit() const noexcept
+    {
+        return std::min(voiceLimit, maxVoices);
+    }
+
+private:
+    static constexpr int unlimited = 1 << 30;
+    static constexpr int adjustInterval = 4;
+
+    uint32_t &getNoteOnTime(const Voice &voice) noexcept
+    {
+        return noteOnTimes[voice.channel & 0x0f][voice.note & 0x7f];
+    }
+
+    /* The oldest, or quietest, of the first numHeld voices */
+    int pickVictim(int numHeld) noexcept
+    {
+        int victim = 0;
+        for (int n = 1; n < numHeld; n++)
+        {
+            const Voice &voice = voices[n];
+            const Voice &candidate = voices[victim];
+            const bool older = getNoteOnTime(voice) < getNoteOnTime(candidate);
+            const bool quieter = voice.velocity < candidate.velocity;
+            if (policy == quietest ? quieter || (voice.velocity == candidate.velocity && older) : older)
+            {
+                victim = n;
+            }
+        }
+        return victim;
+    }
+
+    const double budget;
+    const double releaseLevel;
+    const Policy policy;
+    double smoothedLoad = 0;
+    int voiceLimit = unlimited;
+    int callbacksUntilAdjust = 0;
+    // when each held note started, 0 for notes that are not held
+    uint32_t noteOnTimes[16][128] = {};
+    uint32_t clock = 0;
+    Voice voices[maxVoices];
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "./governor.h"
+
+#include <cstdio>
+#include <vector>
+
+/*
+ * Checks PolyphonyGovernor against simulated callback loads: it must steal
+ * held voices while held voices cause the overload, never lower the limit for
+ * load that stealing can not reduce (release tails, the engine's fixed cost),
+ * and start over after reset. Exits non-zero when a check fails.
+ */
+
+struct Voice
+{
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+};
+
+class SimulatedSynth
+{
+public:
+    void noteOn(PolyphonyGovernor<Voice> &governor, uint8_t note)
+    {
+        const uint8_t message[3] = {0x90, note, 100};
+        governor.noteEvent(message);
+        voices.push_back({0, note, 100});
+    }
+
+    /* Voices that were stolen or released keep playing their release, with velocity 0 like the module reports them */
+    void addReleasingVoices(int count)
+    {
+        for (int n = 0; n < count; n++)
+        {
+            voices.push_back({1, (uint8_t)n, 0});
+        }
+    }
+
+    int update(PolyphonyGovernor<Voice> &governor, double load)
+    {
+        return governor.update(
+            load,
+            [this](Voice *snapshot, int maxVoices)
+            {
+                for (int n = 0; n < (int)voices.size() && n < maxVoices; n++)
+                {
+                    snapshot[n] = voices[n];
+                }
+                return (int)voices.size();
+            },
+            [this](uint8_t, uint8_t note, uint8_t)
+            {
+                for (Voice &voice : voices)
+                {
+                    if (voice.channel == 0 && voice.note == note)
+                    {
+                        voice.channel = 1;
+                    }
+                }
+                numHeld--;
+            });
+    }
+
+    int numHeld = 0;
+
+private:
+    std::vector<Voice> voices;
+};
+
+static int numFailed = 0;
+
+static void check(bool passed, const char *what)
+{
+    printf("%s: %s\n", passed ? "ok" : "FAILED", what);
+    numFailed += passed ? 0 : 1;
+}
+
+int main()
+{
+    {
+        PolyphonyGovernor<Voice> governor(0.75, PolyphonyGovernor<Voice>::oldest);
+        SimulatedSynth synth;
+        synth.addReleasingVoices(20);
+        int numStolen = 0;
+        for (int callback = 0; callback < 100; callback++)
+        {
+            numStolen += synth.update(governor, 0.9);
+        }
+        check(numStolen == 0 && governor.getVoiceLimit() == PolyphonyGovernor<Voice>::maxVoices,
+              "overload from release tails alone leaves the limit alone");
+
+        // the load settles within the hysteresis band, where the limit neither falls nor recovers
+        for (int callback = 0; callback < 100; callback++)
+        {
+            numStolen += synth.update(governor, 0.7);
+        }
+        for (int note = 0; note < 8; note++)
+        {
+            synth.noteOn(governor, (uint8_t)(60 + note));
+        }
+        for (int callback = 0; callback < 100; callback++)
+        {
+            numStolen += synth.update(governor, 0.7);
+        }
+        check(numStolen == 0, "notes played after it are not stolen inside the hysteresis band");
+    }
+
+    {
+        PolyphonyGovernor<Voice> governor(0.75, PolyphonyGovernor<Voice>::oldest);
+        SimulatedSynth synth;
+        for (int note = 0; note < 8; note++)
+        {
+            synth.noteOn(governor, (uint8_t)(60 + note));
+        }
+        synth.numHeld = 8;
+        // the engine's fixed cost keeps the load over budget whatever is stolen
+        for (int callback = 0; callback < 200; callback++)
+        {
+            synth.update(governor, 0.9);
+        }
+        check(synth.numHeld == 1 && governor.getVoiceLimit() == 1, "held voices are stolen down to one under overload");
+
+        synth.noteOn(governor, 80);
+        synth.numHeld++;
+        synth.update(governor, 0.9);
+        check(synth.numHeld == 1, "a note over the limit is stolen");
+
+        governor.reset();
+        synth.noteOn(governor, 81);
+        synth.numHeld++;
+        int numStolen = 0;
+        for (int callback = 0; callback < 100; callback++)
+        {
+            numStolen += synth.update(governor, 0.7);
+        }
+        check(numStolen == 0 && governor.getVoiceLimit() == PolyphonyGovernor<Voice>::maxVoices,
+              "reset starts without a limit");
+    }
+
+    {
+        PolyphonyGovernor<Voice> governor(0.75, PolyphonyGovernor<Voice>::oldest);
+        SimulatedSynth synth;
+        synth.noteOn(governor, 60);
+        synth.numHeld = 1;
+        int numStolen = 0;
+        for (int callback = 0; callback < 100; callback++)
+        {
+            numStolen += synth.update(governor, 0.9);
+        }
+        check(numStolen == 0 && governor.getVoiceLimit() == PolyphonyGovernor<Voice>::maxVoices,
+              "a single held voice is never stolen and does not lower the limit");
+
+        // the load falls below the release level, the limit recovers
+        for (int note = 0; note < 8; note++)
+        {
+            synth.noteOn(governor, (uint8_t)(70 + note));
+        }
+        synth.numHeld += 8;
+        for (int callback = 0; callback < 8; callback++)
+        {
+            synth.update(governor, 0.9);
+        }
+        const int loweredLimit = governor.getVoiceLimit();
+        for (int callback = 0; callback < 400; callback++)
+        {
+            synth.update(governor, 0.2);
+        }
+        check(loweredLimit < 9 && governor.getVoiceLimit() == PolyphonyGovernor<Voice>::maxVoices,
+              "the limit recovers below the release level");
+    }
+
+    return numFailed == 0 ? 0 : 1;
+}
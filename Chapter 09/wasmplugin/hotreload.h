@@ -0,0 +1,223 @@
+#ifndef HOTRELOAD_H
+#define HOTRELOAD_H
+
+#include <JuceHeader.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/*
+ * Hot reloading of the song while the plugin plays. A watcher thread polls the
+ * song file and, once it has changed and then stayed the same for one poll,
+ * builds a new engine with the factory: compiling, loading and instantiating
+ * all happen on that thread. The audio thread picks the engine up with
+ * takeReloaded, crossfades to it and hands the old one back with retire, and
+ * the watcher thread deletes it. Neither side ever blocks the audio thread.
+ *
+ * requestReload builds an engine without waiting for the file to change,
+ * requestReloadFromAudioThread does the same with up to one poll of delay, and
+ * discardPending (e.g. from prepareToPlay) drops an engine that was built for
+ * settings that no longer apply, including one that is still being built.
+ */
+template <typename Engine>
+class HotReloader
+{
+public:
+    using Factory = std::function<std::unique_ptr<Engine>()>;
+
+    HotReloader(File songFile, bool watchFile, Factory factory)
+        : songFile(std::move(songFile)), watchFile(watchFile), factory(std::move(factory)),
+          lastModified(this->songFile.getLastModificationTime()), thread([this] { run(); })
+    {
+    }
+
+    ~HotReloader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+        delete pending.exchange(nullptr);
+        delete retired.exchange(nullptr);
+    }
+
+    void requestReload()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            reloadRequested = true;
+        }
+        wakeup.notify_one();
+    }
+
+    /* Only sets a flag, the watcher thread sees it on its next poll */
+    void requestReloadFromAudioThread() noexcept
+    {
+        reloadFlagged.store(true, std::memory_order_release);
+    }
+
+    void discardPending()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation++;
+        reloadRequested = false;
+        reloadFlagged.store(false, std::memory_order_relaxed);
+        delete pending.exchange(nullptr);
+    }
+
+    /* Audio thread: the newly built engine, which the caller now owns, or nullptr */
+    Engine *takeReloaded() noexcept
+    {
+        if (pending.load(std::memory_order_relaxed) == nullptr)
+        {
+            return nullptr;
+        }
+        return pending.exchange(nullptr, std::memory_order_acq_rel);
+    }
+
+    /* Audio thread: hands an engine over for deletion, false if the last one has not been deleted yet */
+    bool retire(Engine *engine) noexcept
+    {
+        Engine *expected = nullptr;
+        return retired.compare_exchange_strong(expected, engine, std::memory_order_acq_rel);
+    }
+
+private:
+    void run()
+    {
+        bool changed = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            wakeup.wait_for(lock, std::chrono::milliseconds(200), [this] { return stopping || reloadRequested; });
+            delete retired.exchange(nullptr, std::memory_order_acq_rel);
+            if (stopping)
+            {
+                break;
+            }
+
+            if (watchFile)
+            {
+                // editors and compilers write in several steps, so wait until the file has settled
+                Time modified = songFile.getLastModificationTime();
+                if (modified != lastModified)
+                {
+                    lastModified = modified;
+                    changed = true;
+                    continue;
+                }
+            }
+            if (reloadFlagged.exchange(false, std::memory_order_acq_rel))
+            {
+                reloadRequested = true;
+            }
+            if (!changed && !reloadRequested)
+            {
+                continue;
+            }
+            changed = false;
+            reloadRequested = false;
+
+            const uint64 buildGeneration = generation;
+            lock.unlock();
+            std::unique_ptr<Engine> engine = factory();
+            lock.lock();
+            if (engine && generation == buildGeneration)
+            {
+                delete pending.exchange(engine.release(), std::memory_order_acq_rel);
+            }
+        }
+    }
+
+    const File songFile;
+    const bool watchFile;
+    const Factory factory;
+    Time lastModified;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    bool reloadRequested = false;
+    uint64 generation = 0;
+    std::atomic<bool> reloadFlagged{false};
+    std::atomic<Engine *> pending{nullptr};
+    std::atomic<Engine *> retired{nullptr};
+    std::thread thread;
+};
+
+/*
+ * Notes that are down, so that a reloaded engine can take them over and
+ * sustained notes keep sounding through the crossfade.
+ */
+class HeldNotes
+{
+public:
+    void update(const uint8 *rawmessage) noexcept
+    {
+        const int channel = rawmessage[0] & 0x0f;
+        switch (rawmessage[0] & 0xf0)
+        {
+        case 0x90:
+            velocities[channel][rawmessage[1] & 0x7f] = rawmessage[2];
+            break;
+        case 0x80:
+            velocities[channel][rawmessage[1] & 0x7f] = 0;
+            break;
+        case 0xb0:
+            // all sound off and all notes off
+            if (rawmessage[1] == 120 || rawmessage[1] == 123)
+            {
+                std::memset(velocities[channel], 0, sizeof(velocities[channel]));
+            }
+            break;
+        }
+    }
+
+    template <typename Send>
+    void forEach(Send send) const
+    {
+        for (int channel = 0; channel < 16; channel++)
+        {
+            for (int note = 0; note < 128; note++)
+            {
+                if (velocities[channel][note] != 0)
+                {
+                    send((uint8)(0x90 | channel), (uint8)note, velocities[channel][note]);
+                }
+            }
+        }
+    }
+
+    void clear() noexcept
+    {
+        std::memset(velocities, 0, sizeof(velocities));
+    }
+
+private:
+    uint8 velocities[16][128] = {};
+};
+
+/*
+ * Equal power crossfade, the engines play unrelated material: to becomes to
+ * faded in mixed with from faded out, for frames position to position +
+ * numFrames of a fade that is length frames long.
+ */
+inline void crossfade(float *to, const float *from, int numFrames, int position, int length)
+{
+    for (int n = 0; n < numFrames; n++)
+    {
+        const float phase = (float)std::min(position + n, length) / (float)length * MathConstants<float>::halfPi;
+        to[n] = to[n] * std::sin(phase) + from[n] * std::cos(phase);
+    }
+}
+
+#endif
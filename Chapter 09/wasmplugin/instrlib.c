@@ -1,37 +1,332 @@
-#include "./instruments.h"
+#include "./instrlib_internal.h"
+#include "./mixkernels.h"
 
-typedef struct w2c_environment
-{
-    f32 SAMPLERATE;
-} w2c_environment;
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SILENCE_THRESHOLD 1e-5f
+#define SILENCE_HOLD_MILLIS 50
+#define TAIL_MEASURE_MAX_SECONDS 30
 
-w2c_instruments instance;
-w2c_environment environment;
+static pthread_once_t runtime_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool thread_initialized = false;
 
 f32 *w2c_environment_SAMPLERATE(struct w2c_environment *environment)
 {
     return &environment->SAMPLERATE;
 }
 
-void instrlib_init(f32 samplerate)
+static void runtime_init(void)
 {
+    // wasm_rt_init also sets up the thread that calls it
     wasm_rt_init();
-    environment.SAMPLERATE = samplerate;
-    wasm2c_instruments_instantiate(&instance, &environment);
+    thread_initialized = true;
+}
+
+void instrlib_thread_enter(void)
+{
+    if (!thread_initialized)
+    {
+        pthread_once(&runtime_once, runtime_init);
+        if (!thread_initialized)
+        {
+            wasm_rt_init_thread();
+            thread_initialized = true;
+        }
+    }
+}
+
+void instrlib_thread_free(void)
+{
+    if (thread_initialized)
+    {
+        wasm_rt_free_thread();
+        thread_initialized = false;
+    }
+}
+
+instrlib_t *instrlib_create(float samplerate)
+{
+    return instrlib_create_with_memory(samplerate, NULL);
+}
+
+static instrlib_t *allocate(float samplerate, const instrlib_memory_options_t *options)
+{
+    instrlib_thread_enter();
+    instrlib_t *instrlib = calloc(1, sizeof(instrlib_t));
+    if (instrlib == NULL)
+    {
+        return NULL;
+    }
+    instrlib->environment.SAMPLERATE = samplerate;
+    if (options != NULL)
+    {
+        // picked up by wasm_rt_allocate_memory during instantiation
+        instrlib->memory.options = *options;
+    }
+    return instrlib;
+}
+
+static void instantiate(instrlib_t *instrlib)
+{
+    if (instrlib->memory.options.backend == INSTRLIB_MEMORY_SHARED)
+    {
+        // without a template there is no image, but the instance still gets the address space layout it asked for
+        instrlib->memory.options.backend = INSTRLIB_MEMORY_RESERVED;
+    }
+    wasm2c_instruments_instantiate(&instrlib->instance, &instrlib->environment);
 }
 
-void instrlib_fillsamplebufferwithnumsamples(int num_samples) {
-    w2c_instruments_fillSampleBufferWithNumSamples(&instance, num_samples);
+instrlib_t *instrlib_create_with_memory(float samplerate, const instrlib_memory_options_t *options)
+{
+    instrlib_t *instrlib = allocate(samplerate, options);
+    if (instrlib != NULL && !instrlib_instantiate_from_template(instrlib))
+    {
+        instantiate(instrlib);
+    }
+    return instrlib;
 }
 
-f32 *instrlib_getSampleBuffer()
+instrlib_t *instrlib_clone(const instrlib_t *source, const instrlib_memory_options_t *options)
 {
-    wasm_rt_memory_t *memory = w2c_instruments_memory(&instance);
-    u32 *samplebufferaddr = w2c_instruments_samplebuffer(&instance);
+    instrlib_t *instrlib = allocate(instrlib_getSampleRate(source), options);
+    if (instrlib != NULL)
+    {
+        instrlib_clone_instance(instrlib, source, -1, NULL);
+    }
+    return instrlib;
+}
+
+instrlib_t *instrlib_create_instantiated(float samplerate, const instrlib_memory_options_t *options)
+{
+    instrlib_t *instrlib = allocate(samplerate, options);
+    if (instrlib != NULL)
+    {
+        instantiate(instrlib);
+    }
+    return instrlib;
+}
+
+void instrlib_destroy(instrlib_t *instrlib)
+{
+    if (instrlib == NULL)
+    {
+        return;
+    }
+    wasm2c_instruments_free(&instrlib->instance);
+    free(instrlib);
+}
+
+float instrlib_getSampleRate(const instrlib_t *instrlib)
+{
+    return instrlib->environment.SAMPLERATE;
+}
+
+void instrlib_fillsamplebufferwithnumsamples(instrlib_t *instrlib, int num_samples)
+{
+    instrlib_thread_enter();
+    w2c_instruments_fillSampleBufferWithNumSamples(&instrlib->instance, num_samples);
+}
+
+f32 *instrlib_getSampleBuffer(instrlib_t *instrlib)
+{
+    wasm_rt_memory_t *memory = w2c_instruments_memory(&instrlib->instance);
+    u32 *samplebufferaddr = w2c_instruments_samplebuffer(&instrlib->instance);
     return (f32 *)(memory->data + *samplebufferaddr);
 }
 
-void instrlib_shortMessage(u32 d0, u32 d1, u32 d2)
+int instrlib_getNumActiveVoices(instrlib_t *instrlib)
+{
+    return instrlib_getActiveVoices(instrlib, NULL, 0);
+}
+
+int instrlib_getActiveVoices(instrlib_t *instrlib, instrlib_voice_t *voices, int maxVoices)
+{
+    instrlib_thread_enter();
+    // a StaticArray<u8> with channel, note and velocity of every voice slot, all zero when the slot is free
+    u32 snapshot = w2c_instruments_getActiveVoicesStatusSnapshot(&instrlib->instance);
+    const u8 *data = instrlib->instance.w2c_memory.data;
+    u32 length;
+    memcpy(&length, data + snapshot - 4, sizeof(length));
+    int numActive = 0;
+    for (u32 slot = 0; slot + 2 < length; slot += 3)
+    {
+        if (data[snapshot + slot + 1] == 0 && data[snapshot + slot + 2] == 0)
+        {
+            continue;
+        }
+        if (numActive < maxVoices)
+        {
+            voices[numActive] = (instrlib_voice_t){data[snapshot + slot], data[snapshot + slot + 1], data[snapshot + slot + 2]};
+        }
+        numActive++;
+    }
+    return numActive;
+}
+
+bool instrlib_isIdle(const instrlib_t *instrlib)
+{
+    return instrlib->idle;
+}
+
+static void track_silence(instrlib_t *instrlib, const float *renderbuf, int numFrames)
+{
+    if (mix_peak(renderbuf, numFrames) >= SILENCE_THRESHOLD ||
+        mix_peak(renderbuf + INSTRLIB_QUANTUM_FRAMES, numFrames) >= SILENCE_THRESHOLD)
+    {
+        instrlib->silentFrames = 0;
+        return;
+    }
+    instrlib->silentFrames += numFrames;
+    // only ask the module about its voices once the output has been quiet for a while
+    if (instrlib->silentFrames >= SILENCE_HOLD_MILLIS * instrlib_getSampleRate(instrlib) / 1000)
+    {
+        if (instrlib_getNumActiveVoices(instrlib) == 0)
+        {
+            instrlib->idle = true;
+        }
+        else
+        {
+            instrlib->silentFrames = 0;
+        }
+    }
+}
+
+void instrlib_render(instrlib_t *instrlib, float *left, float *right, int numFrames, float gain, bool accumulate)
+{
+    instrlib_thread_enter();
+    for (int pos = 0; pos < numFrames; pos += INSTRLIB_QUANTUM_FRAMES)
+    {
+        int numSamplesToRender = numFrames - pos;
+        if (numSamplesToRender > INSTRLIB_QUANTUM_FRAMES)
+        {
+            numSamplesToRender = INSTRLIB_QUANTUM_FRAMES;
+        }
+        if (instrlib->idle)
+        {
+            if (!accumulate)
+            {
+                memset(left + pos, 0, (numFrames - pos) * sizeof(float));
+                memset(right + pos, 0, (numFrames - pos) * sizeof(float));
+            }
+            return;
+        }
+        w2c_instruments_fillSampleBufferWithNumSamples(&instrlib->instance, numSamplesToRender);
+        const float *renderbuf = instrlib_getSampleBuffer(instrlib);
+        track_silence(instrlib, renderbuf, numSamplesToRender);
+        if (accumulate)
+        {
+            mix_accumulate_gain(left + pos, renderbuf, gain, numSamplesToRender);
+            mix_accumulate_gain(right + pos, renderbuf + INSTRLIB_QUANTUM_FRAMES, gain, numSamplesToRender);
+        }
+        else
+        {
+            mix_copy_gain(left + pos, renderbuf, gain, numSamplesToRender);
+            mix_copy_gain(right + pos, renderbuf + INSTRLIB_QUANTUM_FRAMES, gain, numSamplesToRender);
+        }
+    }
+}
+
+void instrlib_shortMessage(instrlib_t *instrlib, u32 d0, u32 d1, u32 d2)
+{
+    instrlib_thread_enter();
+    instrlib->idle = false;
+    instrlib->silentFrames = 0;
+    w2c_instruments_shortmessage(&instrlib->instance, d0, d1, d2);
+}
+
+u32 instrlib_getDuration(instrlib_t *instrlib)
 {
-    w2c_instruments_shortmessage(&instance, d0, d1, d2);
+    instrlib_thread_enter();
+    return w2c_instruments_getDuration(&instrlib->instance);
+}
+
+void instrlib_playEventsAndFillSampleBuffer(instrlib_t *instrlib)
+{
+    instrlib_thread_enter();
+    w2c_instruments_playEventsAndFillSampleBuffer(&instrlib->instance);
+}
+
+double instrlib_getCurrentTimeMillis(instrlib_t *instrlib)
+{
+    return *w2c_instruments_currentTimeMillis(&instrlib->instance);
+}
+
+void instrlib_seek(instrlib_t *instrlib, double millis)
+{
+    instrlib_thread_enter();
+    w2c_instruments_seek(&instrlib->instance, (u32)millis);
+    *w2c_instruments_currentTimeMillis(&instrlib->instance) = millis;
+}
+
+/* -1 when no instance could be created to measure with */
+static double measure_tail(float samplerate)
+{
+    instrlib_t *instrlib = instrlib_create(samplerate);
+    if (instrlib == NULL)
+    {
+        return -1;
+    }
+    const int quantum = INSTRLIB_QUANTUM_FRAMES;
+    float left[INSTRLIB_QUANTUM_FRAMES];
+    float right[INSTRLIB_QUANTUM_FRAMES];
+    for (u32 channel = 0; channel < 16; channel++)
+    {
+        instrlib_shortMessage(instrlib, 0x90 | channel, 60, 100);
+    }
+    for (int frame = 0; frame < samplerate / 10; frame += quantum)
+    {
+        instrlib_render(instrlib, left, right, quantum, 1.0f, false);
+    }
+    for (u32 channel = 0; channel < 16; channel++)
+    {
+        instrlib_shortMessage(instrlib, 0x80 | channel, 60, 0);
+    }
+
+    // the tail ends with the last quantum that was not silent
+    int lastAudible = 0;
+    for (int frame = 0; frame < samplerate * TAIL_MEASURE_MAX_SECONDS && !instrlib->idle; frame += quantum)
+    {
+        instrlib_render(instrlib, left, right, quantum, 1.0f, false);
+        if (instrlib->silentFrames == 0)
+        {
+            lastAudible = frame + quantum;
+        }
+    }
+    instrlib_destroy(instrlib);
+    return lastAudible / (double)samplerate;
+}
+
+double instrlib_getTailLengthSeconds(float samplerate)
+{
+    static pthread_mutex_t tails_lock = PTHREAD_MUTEX_INITIALIZER;
+    static float samplerates[8];
+    static double tails[8];
+    static int numTails = 0;
+
+    pthread_mutex_lock(&tails_lock);
+    double tail = -1;
+    for (int n = 0; n < numTails; n++)
+    {
+        if (samplerates[n] == samplerate)
+        {
+            tail = tails[n];
+        }
+    }
+    if (tail < 0)
+    {
+        tail = measure_tail(samplerate);
+        // the cache only holds the common rates, anything beyond is measured again
+        if (tail >= 0 && numTails < 8)
+        {
+            samplerates[numTails] = samplerate;
+            tails[numTails] = tail;
+            numTails++;
+        }
+    }
+    pthread_mutex_unlock(&tails_lock);
+    // a failed measurement is tried again on the next call
+    return tail >= 0 ? tail : 0;
 }
@@ -0,0 +1,163 @@
+#ifndef INSTRLIB_H
+#define INSTRLIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One instrlib_t owns one instance of the wasm2c converted synth together with
+ * its own `environment` import (the samplerate). Handles are independent, so
+ * several can be created in one process and each can be driven from its own
+ * thread. A single handle must not be used from two threads at the same time.
+ */
+typedef struct instrlib instrlib_t;
+
+/*
+ * The module is instantiated (data segments, tables and its start function)
+ * only once per samplerate, into a template that is kept for the life of the
+ * process. Every instance created at that samplerate is a clone of it.
+ */
+instrlib_t *instrlib_create(float samplerate);
+void instrlib_destroy(instrlib_t *instrlib);
+
+/*
+ * Linear memory backends. INSTRLIB_MEMORY_DEFAULT leaves allocation to the
+ * wasm2c runtime. INSTRLIB_MEMORY_RESERVED reserves the whole address range the
+ * module can ever use when the instance is created and commits pages in place,
+ * so a memory.grow inside the render call never moves the memory, and within
+ * the precommitted pages it does not page fault.
+ *
+ * INSTRLIB_MEMORY_SHARED works like RESERVED, but rather than copying the
+ * template memory, every instance maps a shared image of it copy-on-write, so
+ * only the pages an instance actually writes take memory of their own.
+ * Locking applies only to pages beyond the image, because locking a private
+ * mapping would copy it, and hugepages are not used for the image.
+ *
+ * Precommitted pages that memory has not grown into yet are resident but stay
+ * inaccessible, so with guard page bounds checking (the default on 64 bit
+ * builds) an access past the memory size still traps. Growing into them takes
+ * an mprotect, but no page faults.
+ */
+typedef enum
+{
+    INSTRLIB_MEMORY_DEFAULT,
+    INSTRLIB_MEMORY_RESERVED,
+    INSTRLIB_MEMORY_SHARED
+} instrlib_memory_backend_t;
+
+/* Back the memory with transparent hugepages where the OS supports it */
+#define INSTRLIB_MEMORY_HUGEPAGES 0x1
+/* mlock committed pages so that rendering never page faults */
+#define INSTRLIB_MEMORY_LOCKED 0x2
+
+typedef struct
+{
+    instrlib_memory_backend_t backend;
+    unsigned int flags;
+    /* wasm pages (64 KiB) committed and faulted in at creation */
+    uint32_t precommitPages;
+} instrlib_memory_options_t;
+
+/* instrlib_create is instrlib_create_with_memory with options NULL (the default backend) */
+instrlib_t *instrlib_create_with_memory(float samplerate, const instrlib_memory_options_t *options);
+
+/*
+ * The flags that are actually in effect. A flag is dropped when the OS refused
+ * it, e.g. mlock beyond RLIMIT_MEMLOCK.
+ */
+unsigned int instrlib_getMemoryFlags(const instrlib_t *instrlib);
+
+/*
+ * Linear memory of the instance that is resident and private to it, and memory
+ * that is still backed by the shared image. On Linux this comes from
+ * /proc/self/pagemap, elsewhere pages equal to the image count as shared.
+ */
+void instrlib_getMemoryUsage(const instrlib_t *instrlib, size_t *residentBytes, size_t *sharedBytes);
+
+/*
+ * A new instance in the current state of source, song position and sounding
+ * voices included. source must not be rendering on another thread meanwhile.
+ * SHARED is not available for clones, they get a private RESERVED memory.
+ */
+instrlib_t *instrlib_clone(const instrlib_t *source, const instrlib_memory_options_t *options);
+
+/*
+ * Puts instrlib back into the state of a newly created instance at its
+ * samplerate without allocating anything: globals and table are copied from the
+ * template, linear memory is restored in place where it differs, and pages the
+ * instance has grown into are kept but zeroed. Hosts can keep an instance per
+ * samplerate and reset it rather than destroying and creating instances on
+ * every reconfiguration. Returns false if there is no template for the
+ * samplerate to restore from, the instance is then unchanged.
+ */
+bool instrlib_reset(instrlib_t *instrlib);
+
+/*
+ * Per thread runtime state (the call stack depth counter and the signal stack
+ * used for guard page traps) is set up lazily on first use. Threads that are
+ * done with rendering may release it again with instrlib_thread_free.
+ */
+void instrlib_thread_free(void);
+
+float instrlib_getSampleRate(const instrlib_t *instrlib);
+void instrlib_fillsamplebufferwithnumsamples(instrlib_t *instrlib, int num_samples);
+float *instrlib_getSampleBuffer(instrlib_t *instrlib);
+void instrlib_shortMessage(instrlib_t *instrlib, uint32_t d0, uint32_t d1, uint32_t d2);
+
+/*
+ * Renders numFrames of live output straight into planar host buffers, scaled
+ * by gain, and either overwrites them or adds to them (accumulate). Any frame
+ * count is fine, rendering happens in quanta of at most 128 frames.
+ */
+void instrlib_render(instrlib_t *instrlib, float *left, float *right, int numFrames, float gain, bool accumulate);
+
+/*
+ * instrlib_render stops running the synth once no voice is active and the
+ * output has stayed below -100 dBFS for 50 ms, and emits silence instead
+ * (or leaves the buffers alone when accumulating). The next
+ * instrlib_shortMessage wakes it up again.
+ */
+bool instrlib_isIdle(const instrlib_t *instrlib);
+
+/* Voices currently playing, from the module's getActiveVoicesStatusSnapshot */
+int instrlib_getNumActiveVoices(instrlib_t *instrlib);
+
+typedef struct
+{
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+} instrlib_voice_t;
+
+/* The same, also copying channel, note and velocity of up to maxVoices of them into voices */
+int instrlib_getActiveVoices(instrlib_t *instrlib, instrlib_voice_t *voices, int maxVoices);
+
+/*
+ * How long the output keeps sounding after the last note off, measured once
+ * per samplerate by releasing middle C on all 16 channels. 0 when no instance
+ * could be created to measure with.
+ */
+double instrlib_getTailLengthSeconds(float samplerate);
+
+/* Playback of the song that is compiled into the module */
+uint32_t instrlib_getDuration(instrlib_t *instrlib);
+void instrlib_playEventsAndFillSampleBuffer(instrlib_t *instrlib);
+double instrlib_getCurrentTimeMillis(instrlib_t *instrlib);
+
+/*
+ * Positions the song at millis. The module itself seeks with millisecond
+ * resolution, the clock is then set to the exact value so that events land on
+ * the same quanta as when playing from the start.
+ */
+void instrlib_seek(instrlib_t *instrlib, double millis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef INSTRLIB_INTERNAL_H
+#define INSTRLIB_INTERNAL_H
+
+/*
+ * Layout of instrlib_t, shared by the parts of instrlib that work directly on
+ * the wasm2c instance. Not for use by hosts, they only see instrlib.h.
+ */
+
+#include "./instruments.h"
+#include "./instrlib.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct w2c_environment
+{
+    f32 SAMPLERATE;
+} w2c_environment;
+
+/* State of the RESERVED and SHARED memory backends, reservation is NULL for the default backend */
+typedef struct
+{
+    instrlib_memory_options_t options;
+    unsigned char *reservation;
+    size_t reservationSize;
+    uint64_t committedSize;
+    // the committed pages up to the memory size, the rest stay PROT_NONE with guard pages
+    uint64_t accessibleSize;
+    // the template image mapped at the start of the reservation (SHARED only)
+    const unsigned char *image;
+    size_t imageSize;
+} instrlib_memory_t;
+
+/*
+ * Every w2c_instruments lives inside an instrlib_t, which is how the memory
+ * backend in instrlib_memory.c finds its state from the wasm_rt_memory_t.
+ */
+struct instrlib
+{
+    w2c_instruments instance;
+    w2c_environment environment;
+    instrlib_memory_t memory;
+    // idle bypass in instrlib_render
+    int silentFrames;
+    bool idle;
+};
+
+/*
+ * All module globals (every w2c_g*, the samplebuffer address and the song
+ * clock) sit between the imported samplerate pointer and the linear memory.
+ */
+#define INSTRLIB_GLOBALS_OFFSET (offsetof(w2c_instruments, w2c_environment_SAMPLERATE) + sizeof(f32 *))
+#define INSTRLIB_GLOBALS_SIZE (offsetof(w2c_instruments, w2c_memory) - INSTRLIB_GLOBALS_OFFSET)
+
+#define INSTRLIB_PAGE_SIZE 65536
+
+/* The sample buffer holds one quantum, the left channel followed by the right */
+#define INSTRLIB_QUANTUM_FRAMES 128
+
+/* Sets up the wasm runtime for the calling thread if that has not happened yet */
+void instrlib_thread_enter(void);
+
+/*
+ * Creates an instance the slow way, through wasm2c_instruments_instantiate.
+ * Templates are made with this, and it is the baseline for startbench.
+ */
+instrlib_t *instrlib_create_instantiated(float samplerate, const instrlib_memory_options_t *options);
+
+/*
+ * Sets up instrlib as a clone of the template for its samplerate, creating the
+ * template on first use (instrlib_template.c). Returns false if the template
+ * could not be created.
+ */
+bool instrlib_instantiate_from_template(instrlib_t *instrlib);
+
+/*
+ * Sets up instrlib as a copy of source. A SHARED instance maps imageFd when it
+ * is given, source must then be the template the image was written from.
+ */
+void instrlib_clone_instance(instrlib_t *instrlib, const instrlib_t *source, int imageFd, const unsigned char *image);
+
+/*
+ * Sets up the memory of a SHARED instance as a private mapping of the image fd,
+ * which holds the template memory. The image stays mapped read-only at image.
+ */
+bool instrlib_memory_map_image(instrlib_t *instrlib, int fd, const unsigned char *image,
+                               const wasm_rt_memory_t *templateMemory);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Linear memory backends for instrlib.
+ *
+ * This file provides wasm_rt_allocate_memory, wasm_rt_grow_memory and
+ * wasm_rt_free_memory for the converted module. The runtime's own versions are
+ * renamed to wasm_rt_impl_* when wasm-rt-impl.c is compiled (see build.sh) and
+ * serve INSTRLIB_MEMORY_DEFAULT.
+ */
+#include "./instrlib_internal.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void wasm_rt_impl_allocate_memory(wasm_rt_memory_t *memory, uint64_t initial_pages, uint64_t max_pages, bool is64);
+uint64_t wasm_rt_impl_grow_memory(wasm_rt_memory_t *memory, uint64_t delta);
+void wasm_rt_impl_free_memory(wasm_rt_memory_t *memory);
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static instrlib_memory_t *memory_state(wasm_rt_memory_t *memory)
+{
+    instrlib_t *instrlib = (instrlib_t *)((unsigned char *)memory - offsetof(instrlib_t, instance.w2c_memory));
+    return &instrlib->memory;
+}
+
+static size_t reservation_size(uint64_t max_pages)
+{
+#if WASM_RT_MEMCHECK_GUARD_PAGES
+    // any 32 bit address plus any 32 bit offset must land inside the reservation
+    (void)max_pages;
+    return 0x200000000ull;
+#else
+    return (size_t)max_pages * INSTRLIB_PAGE_SIZE;
+#endif
+}
+
+static bool commit(instrlib_memory_t *state, uint64_t size, bool prefault)
+{
+    unsigned char *data = state->reservation;
+    uint64_t committed = state->committedSize;
+    if (size <= committed)
+    {
+        return true;
+    }
+    if (mprotect(data + committed, size - committed, PROT_READ | PROT_WRITE) != 0)
+    {
+        return false;
+    }
+    if (state->options.flags & INSTRLIB_MEMORY_LOCKED)
+    {
+        // mlock also faults the pages in
+        if (mlock(data + committed, size - committed) != 0)
+        {
+            state->options.flags &= ~INSTRLIB_MEMORY_LOCKED;
+        }
+    }
+    if (prefault && !(state->options.flags & INSTRLIB_MEMORY_LOCKED))
+    {
+        // fault in now rather than on first use in the render callback
+        memset(data + committed, 0, size - committed);
+    }
+    state->committedSize = size;
+    return true;
+}
+
+/*
+ * Committed pages past the memory size are kept PROT_NONE, so that with guard
+ * pages an access beyond the size still traps. They stay resident (and
+ * locked), so growing into them takes an mprotect but no page faults.
+ */
+static bool protect_beyond(instrlib_memory_t *state, uint64_t size)
+{
+#if WASM_RT_MEMCHECK_GUARD_PAGES
+    if (state->committedSize > size &&
+        mprotect(state->reservation + size, state->committedSize - size, PROT_NONE) != 0)
+    {
+        return false;
+    }
+    state->accessibleSize = size;
+#else
+    (void)size;
+    state->accessibleSize = state->committedSize;
+#endif
+    return true;
+}
+
+/* Makes the first size bytes readable and writable, committing what is not committed yet */
+static bool expose(instrlib_memory_t *state, uint64_t size)
+{
+    uint64_t precommitted = size < state->committedSize ? size : state->committedSize;
+    if (precommitted > state->accessibleSize)
+    {
+        if (mprotect(state->reservation + state->accessibleSize, precommitted - state->accessibleSize,
+                     PROT_READ | PROT_WRITE) != 0)
+        {
+            return false;
+        }
+        state->accessibleSize = precommitted;
+    }
+    if (!commit(state, size, false))
+    {
+        return false;
+    }
+    state->accessibleSize = size > state->accessibleSize ? size : state->accessibleSize;
+    return true;
+}
+
+static bool reserve(instrlib_memory_t *state, uint64_t max_pages)
+{
+    // over-reserve so the data can start on a hugepage boundary
+    size_t size = reservation_size(max_pages);
+    size_t mappedSize = size + HUGEPAGE_SIZE;
+    unsigned char *mapped = mmap(NULL, mappedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+    unsigned char *data = (unsigned char *)(((uintptr_t)mapped + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+    size_t head = data - mapped;
+    if (head > 0)
+    {
+        munmap(mapped, head);
+    }
+    munmap(data + size, mappedSize - head - size);
+
+    state->reservation = data;
+    state->reservationSize = size;
+    state->committedSize = 0;
+    state->accessibleSize = 0;
+    return true;
+}
+
+/* Commits and faults in the precommitted pages, of which only the first size bytes are accessible */
+static bool precommit(instrlib_memory_t *state, uint64_t size, uint64_t initial_pages, uint64_t max_pages)
+{
+    uint64_t pages = state->options.precommitPages;
+    if (pages < initial_pages)
+    {
+        pages = initial_pages;
+    }
+    if (pages > max_pages)
+    {
+        pages = max_pages;
+    }
+    return commit(state, pages * INSTRLIB_PAGE_SIZE, true) && protect_beyond(state, size);
+}
+
+static void allocate_reserved(wasm_rt_memory_t *memory, instrlib_memory_t *state, uint64_t initial_pages,
+                              uint64_t max_pages)
+{
+    if (!reserve(state, max_pages))
+    {
+        wasm_rt_trap(WASM_RT_TRAP_OOB);
+    }
+#ifdef MADV_HUGEPAGE
+    if ((state->options.flags & INSTRLIB_MEMORY_HUGEPAGES) &&
+        madvise(state->reservation, state->reservationSize, MADV_HUGEPAGE) != 0)
+    {
+        state->options.flags &= ~INSTRLIB_MEMORY_HUGEPAGES;
+    }
+#else
+    state->options.flags &= ~INSTRLIB_MEMORY_HUGEPAGES;
+#endif
+    if (!precommit(state, initial_pages * INSTRLIB_PAGE_SIZE, initial_pages, max_pages))
+    {
+        wasm_rt_trap(WASM_RT_TRAP_OOB);
+    }
+
+    memory->data = state->reservation;
+    memory->pages = initial_pages;
+    memory->max_pages = max_pages;
+    memory->size = initial_pages * INSTRLIB_PAGE_SIZE;
+}
+
+bool instrlib_memory_map_image(instrlib_t *instrlib, int fd, const unsigned char *image,
+                               const wasm_rt_memory_t *templateMemory)
+{
+    instrlib_memory_t *state = &instrlib->memory;
+    wasm_rt_memory_t *memory = &instrlib->instance.w2c_memory;
+    state->options.flags &= ~INSTRLIB_MEMORY_HUGEPAGES;
+    if (!reserve(state, templateMemory->max_pages))
+    {
+        return false;
+    }
+    // the image pages stay shared with every other instance until they are written
+    size_t imageSize = templateMemory->size;
+    if (imageSize > 0 &&
+        mmap(state->reservation, imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(state->reservation, state->reservationSize);
+        state->reservation = NULL;
+        return false;
+    }
+    state->committedSize = imageSize;
+    state->accessibleSize = imageSize;
+    state->image = image;
+    state->imageSize = imageSize;
+    if (!precommit(state, imageSize, templateMemory->pages, templateMemory->max_pages))
+    {
+        munmap(state->reservation, state->reservationSize);
+        state->reservation = NULL;
+        return false;
+    }
+
+    memory->data = state->reservation;
+    memory->pages = templateMemory->pages;
+    memory->max_pages = templateMemory->max_pages;
+    memory->size = templateMemory->size;
+    memory->is64 = templateMemory->is64;
+    return true;
+}
+
+void wasm_rt_allocate_memory(wasm_rt_memory_t *memory, uint64_t initial_pages, uint64_t max_pages, bool is64)
+{
+    instrlib_memory_t *state = memory_state(memory);
+    if (state->options.backend == INSTRLIB_MEMORY_RESERVED && !is64)
+    {
+        memory->is64 = is64;
+        allocate_reserved(memory, state, initial_pages, max_pages);
+        return;
+    }
+    state->options.flags = 0;
+    wasm_rt_impl_allocate_memory(memory, initial_pages, max_pages, is64);
+}
+
+uint64_t wasm_rt_grow_memory(wasm_rt_memory_t *memory, uint64_t delta)
+{
+    instrlib_memory_t *state = memory_state(memory);
+    if (state->reservation == NULL)
+    {
+        return wasm_rt_impl_grow_memory(memory, delta);
+    }
+    uint64_t oldPages = memory->pages;
+    uint64_t newPages = oldPages + delta;
+    if (newPages < oldPages || newPages > memory->max_pages)
+    {
+        return (uint64_t)-1;
+    }
+    // committed pages are never returned, so they are still zero past the old size
+    if (!expose(state, newPages * INSTRLIB_PAGE_SIZE))
+    {
+        return (uint64_t)-1;
+    }
+    memory->pages = newPages;
+    memory->size = newPages * INSTRLIB_PAGE_SIZE;
+    return oldPages;
+}
+
+void wasm_rt_free_memory(wasm_rt_memory_t *memory)
+{
+    instrlib_memory_t *state = memory_state(memory);
+    if (state->reservation == NULL)
+    {
+        wasm_rt_impl_free_memory(memory);
+        return;
+    }
+    // unmapping also drops the locks
+    munmap(state->reservation, state->reservationSize);
+    state->reservation = NULL;
+    state->reservationSize = 0;
+    state->committedSize = 0;
+    state->accessibleSize = 0;
+    memory->data = NULL;
+}
+
+unsigned int instrlib_getMemoryFlags(const instrlib_t *instrlib)
+{
+    return instrlib->memory.options.flags;
+}
+
+#ifdef __linux__
+#define PAGEMAP_PRESENT (1ull << 63)
+#define PAGEMAP_FILE_OR_SHARED (1ull << 61)
+
+static bool pagemap_usage(const unsigned char *data, size_t size, size_t *residentBytes, size_t *sharedBytes)
+{
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t numPages = size / pageSize;
+    const off_t first = (off_t)((uintptr_t)data / pageSize * sizeof(uint64_t));
+    uint64_t entries[512];
+    bool ok = true;
+    for (size_t page = 0; page < numPages && ok; page += 512)
+    {
+        size_t count = numPages - page < 512 ? numPages - page : 512;
+        ssize_t bytes = pread(fd, entries, count * sizeof(uint64_t), first + (off_t)(page * sizeof(uint64_t)));
+        ok = bytes == (ssize_t)(count * sizeof(uint64_t));
+        for (size_t n = 0; ok && n < count; n++)
+        {
+            if (!(entries[n] & PAGEMAP_PRESENT))
+            {
+                continue;
+            }
+            // pages of the image that were never written are still the file's, copies are anonymous
+            if (entries[n] & PAGEMAP_FILE_OR_SHARED)
+            {
+                *sharedBytes += pageSize;
+            }
+            else
+            {
+                *residentBytes += pageSize;
+            }
+        }
+    }
+    close(fd);
+    return ok;
+}
+#endif
+
+void instrlib_getMemoryUsage(const instrlib_t *instrlib, size_t *residentBytes, size_t *sharedBytes)
+{
+    const instrlib_memory_t *state = &instrlib->memory;
+    const wasm_rt_memory_t *memory = &instrlib->instance.w2c_memory;
+    size_t size = state->reservation != NULL ? state->committedSize : memory->size;
+    *residentBytes = 0;
+    *sharedBytes = 0;
+#ifdef __linux__
+    if (pagemap_usage(memory->data, size, residentBytes, sharedBytes))
+    {
+        return;
+    }
+    *residentBytes = 0;
+    *sharedBytes = 0;
+#endif
+    // without a page map, image pages that still hold the template contents count as shared
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < state->imageSize; offset += pageSize)
+    {
+        if (memcmp(memory->data + offset, state->image + offset, pageSize) == 0)
+        {
+            *sharedBytes += pageSize;
+        }
+        else
+        {
+            *residentBytes += pageSize;
+        }
+    }
+    *residentBytes += size - state->imageSize;
+}
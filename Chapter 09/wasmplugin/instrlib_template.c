@@ -0,0 +1,232 @@
+/*
+ * Instance templates and cloning.
+ *
+ * A template is an instance that went through the complete instantiation
+ * (data segments, tables and the start function) once for its samplerate and
+ * is never run afterwards. Every instrlib_create at that samplerate clones it,
+ * which is a copy of the globals, the table and the linear memory instead of
+ * rerunning instantiation. The template memory is also written to an anonymous
+ * shared memory file that SHARED instances map copy-on-write, and
+ * instrlib_reset restores an instance from it in place.
+ * Templates live until the process exits.
+ */
+#define _GNU_SOURCE
+#include "./instrlib_internal.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define IMAGE_BLOCK_SIZE 4096
+
+typedef struct instrlib_template
+{
+    instrlib_t *instrlib;
+    int fd;
+    const unsigned char *image;
+    struct instrlib_template *next;
+} instrlib_template_t;
+
+static pthread_mutex_t templates_lock = PTHREAD_MUTEX_INITIALIZER;
+static instrlib_template_t *templates = NULL;
+
+static int create_image_fd(void)
+{
+#ifdef __linux__
+    return memfd_create("instrlib-template", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/instrlib-%d-%p", (int)getpid(), (void *)&name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        shm_unlink(name);
+    }
+    return fd;
+#endif
+}
+
+static bool write_image(int fd, const wasm_rt_memory_t *memory)
+{
+    if (ftruncate(fd, (off_t)memory->size) != 0)
+    {
+        return false;
+    }
+    // the file starts out as a hole, zero blocks are left to it so they take no space
+    static const unsigned char zeroblock[IMAGE_BLOCK_SIZE];
+    for (uint64_t offset = 0; offset < memory->size; offset += IMAGE_BLOCK_SIZE)
+    {
+        const unsigned char *block = memory->data + offset;
+        if (memcmp(block, zeroblock, IMAGE_BLOCK_SIZE) != 0 &&
+            pwrite(fd, block, IMAGE_BLOCK_SIZE, (off_t)offset) != IMAGE_BLOCK_SIZE)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static instrlib_template_t *create_template(float samplerate)
+{
+    instrlib_template_t *template = calloc(1, sizeof(instrlib_template_t));
+    if (template == NULL)
+    {
+        return NULL;
+    }
+    template->instrlib = instrlib_create_instantiated(samplerate, NULL);
+    if (template->instrlib == NULL)
+    {
+        free(template);
+        return NULL;
+    }
+    template->fd = create_image_fd();
+    const wasm_rt_memory_t *memory = &template->instrlib->instance.w2c_memory;
+    if (template->fd >= 0 && write_image(template->fd, memory))
+    {
+        void *image = mmap(NULL, memory->size, PROT_READ, MAP_SHARED, template->fd, 0);
+        if (image != MAP_FAILED)
+        {
+            template->image = image;
+            return template;
+        }
+    }
+    // clones still work without the image, SHARED instances then get a private copy
+    if (template->fd >= 0)
+    {
+        close(template->fd);
+        template->fd = -1;
+    }
+    return template;
+}
+
+static instrlib_template_t *get_template(float samplerate)
+{
+    pthread_mutex_lock(&templates_lock);
+    instrlib_template_t *template = templates;
+    while (template != NULL && instrlib_getSampleRate(template->instrlib) != samplerate)
+    {
+        template = template->next;
+    }
+    if (template == NULL)
+    {
+        template = create_template(samplerate);
+        if (template != NULL)
+        {
+            template->next = templates;
+            templates = template;
+        }
+    }
+    pthread_mutex_unlock(&templates_lock);
+    return template;
+}
+
+static void copy_table_entries(wasm_rt_funcref_table_t *table, const wasm_rt_funcref_table_t *source,
+                               const w2c_instruments *sourceInstance, w2c_instruments *instance)
+{
+    for (uint32_t n = 0; n < source->size && n < table->size; n++)
+    {
+        wasm_rt_funcref_t funcref = source->data[n];
+        // references into the template instance must point into the new one
+        const char *module_instance = funcref.module_instance;
+        if (module_instance >= (const char *)sourceInstance &&
+            module_instance < (const char *)sourceInstance + sizeof(w2c_instruments))
+        {
+            funcref.module_instance = (char *)instance + (module_instance - (const char *)sourceInstance);
+        }
+        table->data[n] = funcref;
+    }
+}
+
+static void copy_table(wasm_rt_funcref_table_t *table, const wasm_rt_funcref_table_t *source,
+                       const w2c_instruments *sourceInstance, w2c_instruments *instance)
+{
+    wasm_rt_allocate_funcref_table(table, source->size, source->max_size);
+    copy_table_entries(table, source, sourceInstance, instance);
+}
+
+static void copy_memory(instrlib_t *instrlib, const wasm_rt_memory_t *source)
+{
+    wasm_rt_memory_t *memory = &instrlib->instance.w2c_memory;
+    memset(memory, 0, sizeof(wasm_rt_memory_t));
+    // goes through the backend in instrlib_memory.c like the instantiation would
+    wasm_rt_allocate_memory(memory, source->pages, source->max_pages, source->is64);
+    memcpy(memory->data, source->data, source->size);
+}
+
+void instrlib_clone_instance(instrlib_t *instrlib, const instrlib_t *source, int imageFd, const unsigned char *image)
+{
+    const w2c_instruments *sourceInstance = &source->instance;
+    w2c_instruments *instance = &instrlib->instance;
+
+    // the globals come along with the rest of the instance, memory and table are replaced below
+    *instance = *sourceInstance;
+    instance->w2c_environment_SAMPLERATE = w2c_environment_SAMPLERATE(&instrlib->environment);
+    bool mapped = false;
+    if (instrlib->memory.options.backend == INSTRLIB_MEMORY_SHARED)
+    {
+        mapped = imageFd >= 0 && instrlib_memory_map_image(instrlib, imageFd, image, &sourceInstance->w2c_memory);
+        if (!mapped)
+        {
+            // only a template has an image, anything else is copied into a private reservation
+            instrlib->memory.options.backend = INSTRLIB_MEMORY_RESERVED;
+        }
+    }
+    if (!mapped)
+    {
+        copy_memory(instrlib, &sourceInstance->w2c_memory);
+    }
+    copy_table(&instance->w2c_T0, &sourceInstance->w2c_T0, sourceInstance, instance);
+}
+
+bool instrlib_instantiate_from_template(instrlib_t *instrlib)
+{
+    const instrlib_template_t *template = get_template(instrlib_getSampleRate(instrlib));
+    if (template == NULL)
+    {
+        return false;
+    }
+    instrlib_clone_instance(instrlib, template->instrlib, template->fd, template->image);
+    return true;
+}
+
+/*
+ * Restores memory block by block and only where it differs, so a SHARED
+ * instance keeps the image pages it never wrote to and nothing is written
+ * where the instance is still as it started.
+ */
+static void restore_memory(wasm_rt_memory_t *memory, const wasm_rt_memory_t *source)
+{
+    static const unsigned char zeroblock[IMAGE_BLOCK_SIZE];
+    for (uint64_t offset = 0; offset < memory->size; offset += IMAGE_BLOCK_SIZE)
+    {
+        unsigned char *block = memory->data + offset;
+        const unsigned char *sourceBlock = offset < source->size ? source->data + offset : zeroblock;
+        if (memcmp(block, sourceBlock, IMAGE_BLOCK_SIZE) != 0)
+        {
+            memcpy(block, sourceBlock, IMAGE_BLOCK_SIZE);
+        }
+    }
+}
+
+bool instrlib_reset(instrlib_t *instrlib)
+{
+    const instrlib_template_t *template = get_template(instrlib_getSampleRate(instrlib));
+    if (template == NULL)
+    {
+        return false;
+    }
+    const w2c_instruments *sourceInstance = &template->instrlib->instance;
+    w2c_instruments *instance = &instrlib->instance;
+    memcpy((unsigned char *)instance + INSTRLIB_GLOBALS_OFFSET, (const unsigned char *)sourceInstance + INSTRLIB_GLOBALS_OFFSET,
+           INSTRLIB_GLOBALS_SIZE);
+    // pages grown into stay, zeroed, so a later memory.grow does not have to commit them again
+    restore_memory(&instance->w2c_memory, &sourceInstance->w2c_memory);
+    copy_table_entries(&instance->w2c_T0, &sourceInstance->w2c_T0, sourceInstance, instance);
+    instrlib->silentFrames = 0;
+    instrlib->idle = false;
+    return true;
+}
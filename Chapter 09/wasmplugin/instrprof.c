@@ -0,0 +1,438 @@
+#include "./instrprof.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Each thread that enters a module function gets its own counters the first
+ * time it does, so the hooks only touch thread local memory. Functions are
+ * kept in a small open addressed table keyed by address, and every distinct
+ * call stack is a node in a call tree, which is what the folded output walks.
+ * The counters outlive their threads so that the profile can be written at
+ * exit. The hooks themselves take a few dozen cycles, which shows up in the
+ * exclusive time of short functions.
+ */
+
+#define MAX_FUNCTIONS 1024    // power of two
+#define MAX_NODES 16384
+#define NODE_SLOTS (2 * MAX_NODES)    // power of two
+#define MAX_DEPTH 256
+#define MAX_INDEX 65536
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+typedef struct
+{
+    const void *address;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+    uint32_t active;    // frames of this function on the stack, so recursion is counted once
+} function_t;
+
+typedef struct
+{
+    const void *address;
+    uint32_t parent;
+    uint64_t calls;
+    uint64_t exclusive;
+} node_t;
+
+typedef struct
+{
+    uint32_t function;
+    uint32_t node;
+    uint64_t start;
+    uint64_t children;
+} frame_t;
+
+typedef struct thread_profile
+{
+    struct thread_profile *next;
+    int index;
+    function_t functions[MAX_FUNCTIONS];
+    node_t nodes[MAX_NODES];
+    uint32_t nodeSlots[NODE_SLOTS];    // node index + 1, 0 is empty
+    uint32_t numNodes;
+    frame_t stack[MAX_DEPTH];
+    int depth;    // can exceed MAX_DEPTH, deeper frames are not recorded
+    uint64_t droppedNodes;
+} thread_profile_t;
+
+static pthread_mutex_t profilesMutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_profile_t *profiles = NULL;
+static int numProfiles = 0;
+static __thread thread_profile_t *profile = NULL;
+
+static char **names = NULL;    // by wasm function index
+static int numNames = 0;
+
+static inline NO_INSTRUMENT uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline NO_INSTRUMENT uint32_t hash_address(const void *address)
+{
+    uint64_t value = (uint64_t)(uintptr_t)address;
+    return (uint32_t)((value * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static void NO_INSTRUMENT write_profile_at_exit(void)
+{
+    const char *namesPath = getenv("INSTRPROF_NAMES");
+    if (namesPath && instrprof_load_names(namesPath) < 0)
+    {
+        fprintf(stderr, "instrprof: can't read names from %s\n", namesPath);
+    }
+    const char *format = getenv("INSTRPROF_FORMAT");
+    const char *output = getenv("INSTRPROF_OUTPUT");
+    FILE *fp = output ? fopen(output, "w") : stderr;
+    if (!fp)
+    {
+        fprintf(stderr, "instrprof: can't write %s\n", output);
+        return;
+    }
+    instrprof_dump(fp, format && strcmp(format, "folded") == 0 ? INSTRPROF_FOLDED : INSTRPROF_REPORT);
+    if (fp != stderr)
+    {
+        fclose(fp);
+    }
+}
+
+static NO_INSTRUMENT thread_profile_t *create_profile(void)
+{
+    thread_profile_t *created = calloc(1, sizeof(thread_profile_t));
+    if (!created)
+    {
+        return NULL;
+    }
+    created->numNodes = 1;    // the root, with no function
+    pthread_mutex_lock(&profilesMutex);
+    if (!profiles)
+    {
+        atexit(write_profile_at_exit);
+    }
+    created->index = numProfiles++;
+    created->next = profiles;
+    profiles = created;
+    pthread_mutex_unlock(&profilesMutex);
+    return created;
+}
+
+static inline NO_INSTRUMENT uint32_t find_function(thread_profile_t *p, const void *address)
+{
+    uint32_t slot = hash_address(address) & (MAX_FUNCTIONS - 1);
+    while (p->functions[slot].address != address && p->functions[slot].address != NULL)
+    {
+        slot = (slot + 1) & (MAX_FUNCTIONS - 1);
+    }
+    // the module has far fewer functions than slots, so the table never fills
+    p->functions[slot].address = address;
+    return slot;
+}
+
+static inline NO_INSTRUMENT uint32_t find_node(thread_profile_t *p, uint32_t parent, const void *address)
+{
+    uint32_t slot = (hash_address(address) ^ (parent * 0x85EBCA6Bu)) & (NODE_SLOTS - 1);
+    for (;;)
+    {
+        uint32_t entry = p->nodeSlots[slot];
+        if (entry == 0)
+        {
+            if (p->numNodes == MAX_NODES)
+            {
+                // out of nodes, the time goes to the caller's stack
+                p->droppedNodes++;
+                return parent;
+            }
+            uint32_t node = p->numNodes++;
+            p->nodes[node].address = address;
+            p->nodes[node].parent = parent;
+            p->nodeSlots[slot] = node + 1;
+            return node;
+        }
+        node_t *candidate = &p->nodes[entry - 1];
+        if (candidate->address == address && candidate->parent == parent)
+        {
+            return entry - 1;
+        }
+        slot = (slot + 1) & (NODE_SLOTS - 1);
+    }
+}
+
+void NO_INSTRUMENT __cyg_profile_func_enter(void *function, void *callSite)
+{
+    (void)callSite;
+    thread_profile_t *p = profile;
+    if (!p)
+    {
+        p = profile = create_profile();
+        if (!p)
+        {
+            return;
+        }
+    }
+    if (p->depth++ >= MAX_DEPTH)
+    {
+        return;
+    }
+    frame_t *frame = &p->stack[p->depth - 1];
+    frame->function = find_function(p, function);
+    frame->node = find_node(p, p->depth > 1 ? p->stack[p->depth - 2].node : 0, function);
+    frame->children = 0;
+    p->functions[frame->function].active++;
+    frame->start = read_cycles();
+}
+
+void NO_INSTRUMENT __cyg_profile_func_exit(void *function, void *callSite)
+{
+    (void)function;
+    (void)callSite;
+    uint64_t now = read_cycles();
+    thread_profile_t *p = profile;
+    if (!p || p->depth == 0)
+    {
+        return;
+    }
+    if (p->depth-- > MAX_DEPTH)
+    {
+        return;
+    }
+    frame_t *frame = &p->stack[p->depth];
+    uint64_t inclusive = now - frame->start;
+    uint64_t exclusive = inclusive - frame->children;
+    function_t *f = &p->functions[frame->function];
+    f->calls++;
+    f->exclusive += exclusive;
+    if (--f->active == 0)
+    {
+        f->inclusive += inclusive;
+    }
+    p->nodes[frame->node].calls++;
+    p->nodes[frame->node].exclusive += exclusive;
+    if (p->depth > 0)
+    {
+        p->stack[p->depth - 1].children += inclusive;
+    }
+}
+
+int NO_INSTRUMENT instrprof_load_names(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        return -1;
+    }
+    int loaded = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp))
+    {
+        int index;
+        char name[1024];
+        // wasm-objdump prints " - func[12] <name>", otherwise "12 name"
+        const char *func = strstr(line, "func[");
+        if (func ? sscanf(func, "func[%d] <%1023[^>]>", &index, name) != 2
+                 : sscanf(line, "%d %1023s", &index, name) != 2)
+        {
+            continue;
+        }
+        if (index < 0 || index >= MAX_INDEX)
+        {
+            continue;
+        }
+        if (index >= numNames)
+        {
+            int grown = index + 1;
+            char **resized = realloc(names, grown * sizeof(char *));
+            if (!resized)
+            {
+                break;
+            }
+            memset(resized + numNames, 0, (grown - numNames) * sizeof(char *));
+            names = resized;
+            numNames = grown;
+        }
+        free(names[index]);
+        names[index] = strdup(name);
+        loaded++;
+    }
+    fclose(fp);
+    return loaded;
+}
+
+/* fN becomes its sidecar name, everything else keeps the name wasm2c gave it */
+static NO_INSTRUMENT const char *function_name(const void *address, char *buffer, size_t size)
+{
+    for (int n = 0; n < instrprof_num_symbols; n++)
+    {
+        if (instrprof_symbols[n].address != address)
+        {
+            continue;
+        }
+        const char *symbol = instrprof_symbols[n].symbol;
+        int index;
+        char rest;
+        if (sscanf(symbol, "f%d%c", &index, &rest) == 1 && index >= 0 && index < numNames && names[index])
+        {
+            return names[index];
+        }
+        return symbol;
+    }
+    // not one of the module's functions, e.g. a runtime helper the compiler kept out of line
+    snprintf(buffer, size, "%p", address);
+    return buffer;
+}
+
+typedef struct
+{
+    const void *address;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+} total_t;
+
+static int NO_INSTRUMENT compare_exclusive(const void *a, const void *b)
+{
+    uint64_t ea = ((const total_t *)a)->exclusive;
+    uint64_t eb = ((const total_t *)b)->exclusive;
+    return ea < eb ? 1 : ea > eb ? -1 : 0;
+}
+
+static void NO_INSTRUMENT dump_report(FILE *fp)
+{
+    // functions are merged across threads by address
+    total_t *totals = calloc((size_t)numProfiles * MAX_FUNCTIONS, sizeof(total_t));
+    if (!totals)
+    {
+        return;
+    }
+    int numTotals = 0;
+    uint64_t totalCycles = 0;
+    uint64_t droppedNodes = 0;
+    for (thread_profile_t *p = profiles; p; p = p->next)
+    {
+        droppedNodes += p->droppedNodes;
+        for (int slot = 0; slot < MAX_FUNCTIONS; slot++)
+        {
+            const function_t *f = &p->functions[slot];
+            if (!f->address || f->calls == 0)
+            {
+                continue;
+            }
+            int t = 0;
+            while (t < numTotals && totals[t].address != f->address)
+            {
+                t++;
+            }
+            if (t == numTotals)
+            {
+                totals[numTotals++].address = f->address;
+            }
+            totals[t].calls += f->calls;
+            totals[t].inclusive += f->inclusive;
+            totals[t].exclusive += f->exclusive;
+            totalCycles += f->exclusive;
+        }
+    }
+    qsort(totals, numTotals, sizeof(total_t), compare_exclusive);
+
+    fprintf(fp, "%d threads, %.3f Mcycles in module functions\n", numProfiles, totalCycles * 1e-6);
+    fprintf(fp, "%-48s %12s %14s %8s %14s %8s %12s\n", "function", "calls", "incl Mcycles", "incl %", "excl Mcycles",
+            "excl %", "cycles/call");
+    double percent = totalCycles ? 100.0 / totalCycles : 0;
+    for (int t = 0; t < numTotals; t++)
+    {
+        char buffer[64];
+        fprintf(fp, "%-48s %12llu %14.3f %8.2f %14.3f %8.2f %12.1f\n",
+                function_name(totals[t].address, buffer, sizeof(buffer)), (unsigned long long)totals[t].calls,
+                totals[t].inclusive * 1e-6, totals[t].inclusive * percent, totals[t].exclusive * 1e-6,
+                totals[t].exclusive * percent, (double)totals[t].exclusive / totals[t].calls);
+    }
+    if (droppedNodes)
+    {
+        fprintf(fp, "%llu calls had too many distinct stacks and were folded into their caller\n",
+                (unsigned long long)droppedNodes);
+    }
+    free(totals);
+}
+
+static void NO_INSTRUMENT dump_folded(FILE *fp)
+{
+    // one line per call stack and thread, flamegraph.pl adds up equal stacks
+    for (thread_profile_t *p = profiles; p; p = p->next)
+    {
+        for (uint32_t node = 1; node < p->numNodes; node++)
+        {
+            if (p->nodes[node].exclusive == 0)
+            {
+                continue;
+            }
+            uint32_t path[MAX_DEPTH];
+            int length = 0;
+            for (uint32_t n = node; n != 0 && length < MAX_DEPTH; n = p->nodes[n].parent)
+            {
+                path[length++] = n;
+            }
+            fprintf(fp, "thread %d", p->index);
+            while (length > 0)
+            {
+                char buffer[64];
+                fprintf(fp, ";%s", function_name(p->nodes[path[--length]].address, buffer, sizeof(buffer)));
+            }
+            fprintf(fp, " %llu\n", (unsigned long long)p->nodes[node].exclusive);
+        }
+    }
+}
+
+void NO_INSTRUMENT instrprof_dump(FILE *fp, instrprof_format_t format)
+{
+    pthread_mutex_lock(&profilesMutex);
+    if (format == INSTRPROF_FOLDED)
+    {
+        dump_folded(fp);
+    }
+    else
+    {
+        dump_report(fp);
+    }
+    pthread_mutex_unlock(&profilesMutex);
+    fflush(fp);
+}
+
+void NO_INSTRUMENT instrprof_reset(void)
+{
+    pthread_mutex_lock(&profilesMutex);
+    for (thread_profile_t *p = profiles; p; p = p->next)
+    {
+        for (int slot = 0; slot < MAX_FUNCTIONS; slot++)
+        {
+            p->functions[slot].calls = 0;
+            p->functions[slot].inclusive = 0;
+            p->functions[slot].exclusive = 0;
+        }
+        for (uint32_t node = 0; node < p->numNodes; node++)
+        {
+            p->nodes[node].calls = 0;
+            p->nodes[node].exclusive = 0;
+        }
+        p->droppedNodes = 0;
+    }
+    pthread_mutex_unlock(&profilesMutex);
+}
@@ -0,0 +1,53 @@
+#ifndef INSTRPROF_H
+#define INSTRPROF_H
+
+#include <stdio.h>
+
+/*
+ * Per function profiler for the wasm2c generated synth, used by the profiling
+ * build in build.sh. instruments.c is compiled with -finstrument-functions and
+ * every call into a module function records its calls and its inclusive and
+ * exclusive cycles (the TSC on x86-64, the virtual counter on arm64) in
+ * counters that belong to the calling thread, so the hooks never lock.
+ *
+ * wasm2c names the module's functions fN after their wasm function index when
+ * the module has no name section. A sidecar file maps them back to source
+ * names, either the name section dump of an unstripped build of the same
+ * module (wasm-objdump -x -j name song.wasm) or plain "index name" lines.
+ *
+ * When the program exits the profile is written to stderr, or wherever the
+ * environment says:
+ *   INSTRPROF_OUTPUT  file to write to
+ *   INSTRPROF_FORMAT  report (calls and cycles by exclusive time, the default)
+ *                     or folded (stacks for flamegraph.pl)
+ *   INSTRPROF_NAMES   sidecar name map
+ * e.g. INSTRPROF_FORMAT=folded INSTRPROF_OUTPUT=song.folded ./songrender_profile
+ * song.wav && flamegraph.pl song.folded > song.svg
+ */
+
+typedef enum
+{
+    INSTRPROF_REPORT,
+    INSTRPROF_FOLDED
+} instrprof_format_t;
+
+typedef struct
+{
+    const void *address;
+    const char *symbol;
+} instrprof_symbol_t;
+
+/* Generated by build.sh from instruments.c, see instrprof_symbols.c */
+extern const instrprof_symbol_t instrprof_symbols[];
+extern const int instrprof_num_symbols;
+
+/* Loads a sidecar name map, returns the number of names or -1 if the file can't be read */
+int instrprof_load_names(const char *path);
+
+/* Writes the counters of all threads so far, call it while no thread is rendering */
+void instrprof_dump(FILE *fp, instrprof_format_t format);
+
+/* Zeroes the counters of all threads, e.g. to leave out instantiation */
+void instrprof_reset(void);
+
+#endif
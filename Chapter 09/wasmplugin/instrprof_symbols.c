@@ -0,0 +1,16 @@
+/*
+ * The profiling build compiles this instead of instruments.c. Including the
+ * generated code makes its static functions visible, so their addresses can
+ * be listed for instrprof to name. build.sh generates instrprof_symbols.h, an
+ * INSTRPROF_SYMBOL line for each function declared in instruments.c.
+ */
+#include "./instruments.c"
+#include "./instrprof.h"
+
+#define INSTRPROF_SYMBOL(name) {(const void *)w2c_instruments_##name, #name},
+
+const instrprof_symbol_t instrprof_symbols[] = {
+#include "instrprof_symbols.h"
+};
+
+const int instrprof_num_symbols = sizeof(instrprof_symbols) / sizeof(instrprof_symbols[0]);
@@ -0,0 +1,163 @@
+#include "./instrlib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUANTUM_FRAMES 128
+
+typedef struct
+{
+    const char *name;
+    instrlib_memory_options_t options;
+} backend_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-d seconds] [-c precommitpages] [-n runs]\n"
+            "  renders the song once per memory backend and reports ns per sample and the\n"
+            "  linear memory that stayed private to the instance or shared with the template\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -d  seconds of song to render per run (default: the whole song)\n"
+            "  -c  wasm pages to precommit for the precommit backends (default 64)\n"
+            "  -n  runs per backend, the fastest is reported (default 3)\n",
+            name);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long minor_faults(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static const char *flag_names(unsigned int flags)
+{
+    switch (flags & (INSTRLIB_MEMORY_HUGEPAGES | INSTRLIB_MEMORY_LOCKED))
+    {
+    case INSTRLIB_MEMORY_HUGEPAGES:
+        return "huge";
+    case INSTRLIB_MEMORY_LOCKED:
+        return "locked";
+    case INSTRLIB_MEMORY_HUGEPAGES | INSTRLIB_MEMORY_LOCKED:
+        return "huge,locked";
+    default:
+        return "-";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    double seconds = 0;
+    uint32_t precommitPages = 64;
+    int runs = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:c:n:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'c':
+            precommitPages = (uint32_t)atoi(optarg);
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || samplerate <= 0 || seconds < 0 || runs < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (seconds == 0)
+    {
+        instrlib_t *instrlib = instrlib_create(samplerate);
+        seconds = instrlib_getDuration(instrlib) / 1000.0;
+        instrlib_destroy(instrlib);
+    }
+    int numQuanta = (int)(seconds * samplerate / QUANTUM_FRAMES) + 1;
+
+    const unsigned int all = INSTRLIB_MEMORY_HUGEPAGES | INSTRLIB_MEMORY_LOCKED;
+    const backend_t backends[] = {
+        {"default", {INSTRLIB_MEMORY_DEFAULT, 0, 0}},
+        {"reserved", {INSTRLIB_MEMORY_RESERVED, 0, 0}},
+        {"reserved+precommit", {INSTRLIB_MEMORY_RESERVED, 0, precommitPages}},
+        {"reserved+precommit+huge", {INSTRLIB_MEMORY_RESERVED, INSTRLIB_MEMORY_HUGEPAGES, precommitPages}},
+        {"reserved+precommit+locked", {INSTRLIB_MEMORY_RESERVED, INSTRLIB_MEMORY_LOCKED, precommitPages}},
+        {"reserved+precommit+huge+locked", {INSTRLIB_MEMORY_RESERVED, all, precommitPages}},
+        {"shared", {INSTRLIB_MEMORY_SHARED, 0, 0}},
+        {"shared+precommit+locked", {INSTRLIB_MEMORY_SHARED, INSTRLIB_MEMORY_LOCKED, precommitPages}},
+    };
+    const int numBackends = sizeof(backends) / sizeof(backends[0]);
+
+    printf("%d quanta (%.1f s) at %.0f Hz, best of %d runs\n", numQuanta, numQuanta * QUANTUM_FRAMES / samplerate,
+           samplerate, runs);
+    printf("%-32s %12s %10s %14s %12s %12s %12s %12s\n", "backend", "in effect", "create us", "ns/sample",
+           "worst us", "faults", "private KiB", "shared KiB");
+    for (int b = 0; b < numBackends; b++)
+    {
+        double bestCreate = 0, bestNs = 0, bestWorst = 0;
+        long bestFaults = 0;
+        size_t residentBytes = 0, sharedBytes = 0;
+        unsigned int flags = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            double createStart = now_seconds();
+            instrlib_t *instrlib = instrlib_create_with_memory(samplerate, &backends[b].options);
+            double createTime = now_seconds() - createStart;
+            flags = instrlib_getMemoryFlags(instrlib);
+
+            long faultsBefore = minor_faults();
+            double worst = 0;
+            double renderStart = now_seconds();
+            for (int quantum = 0; quantum < numQuanta; quantum++)
+            {
+                double quantumStart = now_seconds();
+                instrlib_playEventsAndFillSampleBuffer(instrlib);
+                double quantumTime = now_seconds() - quantumStart;
+                if (quantumTime > worst)
+                {
+                    worst = quantumTime;
+                }
+            }
+            double renderTime = now_seconds() - renderStart;
+            long faults = minor_faults() - faultsBefore;
+            instrlib_getMemoryUsage(instrlib, &residentBytes, &sharedBytes);
+            instrlib_destroy(instrlib);
+
+            double ns = renderTime * 1e9 / ((double)numQuanta * QUANTUM_FRAMES);
+            if (run == 0 || ns < bestNs)
+            {
+                bestNs = ns;
+                bestCreate = createTime;
+                bestWorst = worst;
+                bestFaults = faults;
+            }
+        }
+        printf("%-32s %12s %10.0f %14.2f %12.1f %12ld %12zu %12zu\n", backends[b].name, flag_names(flags),
+               bestCreate * 1e6, bestNs, bestWorst * 1e6, bestFaults, residentBytes / 1024, sharedBytes / 1024);
+    }
+    return 0;
+}
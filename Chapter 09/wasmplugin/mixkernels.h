@@ -0,0 +1,84 @@
+#ifndef MIXKERNELS_H
+#define MIXKERNELS_H
+
+#include <string.h>
+
+/*
+ * Small vectorized kernels for moving planar float audio around. They use the
+ * GCC/Clang vector extensions so the same code becomes SSE/AVX on x86 and NEON
+ * on Apple Silicon. Buffers do not need any particular alignment.
+ */
+
+typedef float mix_v4sf __attribute__((vector_size(16)));
+typedef int mix_v4si __attribute__((vector_size(16)));
+
+static inline mix_v4sf mix_load(const float *src)
+{
+    mix_v4sf v;
+    memcpy(&v, src, sizeof(v));
+    return v;
+}
+
+static inline void mix_store(float *dst, mix_v4sf v)
+{
+    memcpy(dst, &v, sizeof(v));
+}
+
+/* dst[i] = src[i] * gain */
+static inline void mix_copy_gain(float *__restrict dst, const float *__restrict src, float gain, int num_frames)
+{
+    const mix_v4sf g = {gain, gain, gain, gain};
+    int ndx = 0;
+    for (; ndx + 8 <= num_frames; ndx += 8)
+    {
+        mix_store(dst + ndx, mix_load(src + ndx) * g);
+        mix_store(dst + ndx + 4, mix_load(src + ndx + 4) * g);
+    }
+    for (; ndx < num_frames; ndx++)
+    {
+        dst[ndx] = src[ndx] * gain;
+    }
+}
+
+/* dst[i] += src[i] * gain */
+static inline void mix_accumulate_gain(float *__restrict dst, const float *__restrict src, float gain, int num_frames)
+{
+    const mix_v4sf g = {gain, gain, gain, gain};
+    int ndx = 0;
+    for (; ndx + 8 <= num_frames; ndx += 8)
+    {
+        mix_store(dst + ndx, mix_load(dst + ndx) + mix_load(src + ndx) * g);
+        mix_store(dst + ndx + 4, mix_load(dst + ndx + 4) + mix_load(src + ndx + 4) * g);
+    }
+    for (; ndx < num_frames; ndx++)
+    {
+        dst[ndx] += src[ndx] * gain;
+    }
+}
+
+/* Largest absolute sample value */
+static inline float mix_peak(const float *src, int num_frames)
+{
+    const mix_v4si absmask = {0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff};
+    mix_v4si peak = {0, 0, 0, 0};
+    int ndx = 0;
+    for (; ndx + 4 <= num_frames; ndx += 4)
+    {
+        // without the sign bit, floats compare like their bit patterns do as integers
+        mix_v4si v = (mix_v4si)mix_load(src + ndx) & absmask;
+        mix_v4si greater = v > peak;
+        peak = (v & greater) | (peak & ~greater);
+    }
+    mix_v4sf peakf = (mix_v4sf)peak;
+    float result = peakf[0] > peakf[1] ? peakf[0] : peakf[1];
+    result = result > peakf[2] ? result : peakf[2];
+    result = result > peakf[3] ? result : peakf[3];
+    for (; ndx < num_frames; ndx++)
+    {
+        float v = src[ndx] < 0.0f ? -src[ndx] : src[ndx];
+        result = result > v ? result : v;
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,214 @@
+#include "./renderengine.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+    double nsPerSample;
+    double callbackP50;
+    double callbackP99;
+    double callbackMax;
+    int realtimeWorkers;
+    bool matchesSerial;
+} result_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-d seconds] [-b blockframes] [-t tracks] [-j maxthreads] [-R]\n"
+            "  plays a dense multitimbral pattern, every track an instance on its own MIDI\n"
+            "  channel, through a renderengine with 1 to maxthreads threads and reports ns per\n"
+            "  sample, callback times and the speedup over one thread as JSON. Exits with 1\n"
+            "  when the output of any thread count differs from the serial render\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -d  seconds to render per thread count (default 10)\n"
+            "  -b  frames per callback (default 128)\n"
+            "  -t  tracks (default 16)\n"
+            "  -j  most threads to try, the calling thread included (default 8)\n"
+            "  -R  render on a SCHED_FIFO thread, whose priority the workers take over\n",
+            name);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Four note chords every quarter of a second on every track, each track on its
+ * own channel and a step above the previous one, held for three quarters, so
+ * that every track keeps about 12 voices going.
+ */
+static void play_pattern(renderengine_t *engine, int block, int blockFrames, float samplerate)
+{
+    static const int chord[4] = {0, 4, 7, 12};
+    const int beatFrames = (int)(samplerate / 4);
+    const int start = block * blockFrames;
+    for (int beat = (start + beatFrames - 1) / beatFrames; beat * beatFrames < start + blockFrames; beat++)
+    {
+        for (int n = 0; n < renderengine_getNumTracks(engine); n++)
+        {
+            instrlib_t *track = renderengine_getTrack(engine, n);
+            const int channel = n % 16;
+            const int root = 36 + (n * 5 + beat * 7) % 36;
+            const int releasedRoot = 36 + (n * 5 + (beat - 3) * 7) % 36;
+            for (int note = 0; note < 4; note++)
+            {
+                if (beat >= 3)
+                {
+                    instrlib_shortMessage(track, 0x80 | channel, releasedRoot + chord[note], 0);
+                }
+                instrlib_shortMessage(track, 0x90 | channel, root + chord[note], 80 + note * 10);
+            }
+        }
+    }
+}
+
+static result_t run(int numTracks, int numThreads, float samplerate, int blockFrames, int numBlocks,
+                    unsigned int flags, const float *serial, float *output)
+{
+    result_t result = {0};
+    renderengine_t *engine = renderengine_create_with_flags(numTracks, numThreads, samplerate, blockFrames, flags);
+    if (engine == NULL)
+    {
+        fprintf(stderr, "could not create a renderengine with %d threads\n", numThreads);
+        exit(1);
+    }
+    for (int n = 0; n < numTracks; n++)
+    {
+        renderengine_setTrackGainPan(engine, n, 1.0f / numTracks, n % 2 == 0 ? -0.5f : 0.5f);
+    }
+    double *callbackMicros = malloc(numBlocks * sizeof(double));
+
+    double start = now_seconds();
+    for (int block = 0; block < numBlocks; block++)
+    {
+        double callbackStart = now_seconds();
+        play_pattern(engine, block, blockFrames, samplerate);
+        float *left = output + (size_t)block * 2 * blockFrames;
+        renderengine_render(engine, left, left + blockFrames, blockFrames);
+        callbackMicros[block] = (now_seconds() - callbackStart) * 1e6;
+    }
+    double elapsed = now_seconds() - start;
+
+    qsort(callbackMicros, numBlocks, sizeof(double), compare_doubles);
+    result.nsPerSample = elapsed * 1e9 / ((double)numBlocks * blockFrames);
+    result.callbackP50 = callbackMicros[numBlocks / 2];
+    result.callbackP99 = callbackMicros[(int)(numBlocks * 0.99)];
+    result.callbackMax = callbackMicros[numBlocks - 1];
+    result.realtimeWorkers = renderengine_getNumRealtimeWorkers(engine);
+    // every track renders on one thread at a time and the mix is summed in track order, so threads change nothing
+    result.matchesSerial = serial == NULL || memcmp(serial, output, (size_t)numBlocks * 2 * blockFrames * sizeof(float)) == 0;
+
+    free(callbackMicros);
+    renderengine_destroy(engine);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    double seconds = 10;
+    int blockFrames = 128;
+    int numTracks = 16;
+    int maxThreads = 8;
+    unsigned int flags = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:b:t:j:Rh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'b':
+            blockFrames = atoi(optarg);
+            break;
+        case 't':
+            numTracks = atoi(optarg);
+            break;
+        case 'j':
+            maxThreads = atoi(optarg);
+            break;
+        case 'R':
+            flags |= RENDERENGINE_REALTIME;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || samplerate <= 0 || seconds <= 0 || blockFrames < 1 || numTracks < 1 || maxThreads < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const int numBlocks = (int)ceil(seconds * samplerate / blockFrames);
+    const size_t outputFloats = (size_t)numBlocks * 2 * blockFrames;
+    float *serial = malloc(outputFloats * sizeof(float));
+    float *output = malloc(outputFloats * sizeof(float));
+
+    if (flags & RENDERENGINE_REALTIME)
+    {
+        // like an audio thread, which the workers get their priority from
+        struct sched_param param = {.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10};
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+        {
+            fprintf(stderr, "could not make the benchmark thread realtime, the workers stay at normal priority\n");
+        }
+    }
+
+    // the templates for the samplerate are created before anything is timed
+    instrlib_destroy(instrlib_create(samplerate));
+
+    printf("{\n  \"samplerate\": %.0f,\n  \"seconds\": %g,\n  \"block_frames\": %d,\n  \"tracks\": %d,\n  \"cpus\": %ld,\n",
+           samplerate, seconds, blockFrames, numTracks, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"results\": [");
+    double serialNs = 0;
+    bool allMatch = true;
+    for (int threads = 1; threads <= maxThreads && threads <= numTracks; threads++)
+    {
+        result_t result = run(numTracks, threads, samplerate, blockFrames, numBlocks, flags, threads == 1 ? NULL : serial,
+                              threads == 1 ? serial : output);
+        if (threads == 1)
+        {
+            serialNs = result.nsPerSample;
+        }
+        allMatch = allMatch && result.matchesSerial;
+        printf("%s\n    {\"threads\": %d, \"realtime_workers\": %d, \"ns_per_sample\": %.2f, \"speedup\": %.2f, "
+               "\"callback_us\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}, \"matches_serial\": %s}",
+               threads == 1 ? "" : ",", threads, result.realtimeWorkers, result.nsPerSample, serialNs / result.nsPerSample,
+               result.callbackP50, result.callbackP99, result.callbackMax, result.matchesSerial ? "true" : "false");
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+
+    free(output);
+    free(serial);
+    if (!allMatch)
+    {
+        fprintf(stderr, "parallel output differs from the serial render\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "./instrlib.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Measures how far note onsets land from the frame their MIDI event was
+ * scheduled at. Each note is played on a fresh instance in a block of blockSize
+ * frames, once the way WasmSynth::processBlock schedules events (rendering is
+ * split at the event's frame) and once with every event sent before the block
+ * (the old behaviour). The reference is a note at frame 0 of a block, which
+ * gives the synth's own attack delay.
+ */
+
+#define MAX_BLOCK_SIZE 8192
+#define RENDER_BLOCKS 4
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-b blocksize] [-n note] [-t thresholddb]\n"
+            "  reports the onset error of notes scheduled at every frame offset in a block\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -b  host block size (default 1024)\n"
+            "  -n  midi note to play (default 60)\n"
+            "  -t  onset threshold in dBFS (default -60)\n",
+            name);
+}
+
+/* Renders RENDER_BLOCKS blocks with a note-on at eventFrame, returns the first frame above threshold or -1 */
+static int render_onset(float samplerate, int blockSize, int note, int eventFrame, int split, float threshold)
+{
+    static float left[MAX_BLOCK_SIZE];
+    static float right[MAX_BLOCK_SIZE];
+    instrlib_t *instrlib = instrlib_create(samplerate);
+    int onset = -1;
+    for (int block = 0; block < RENDER_BLOCKS && onset < 0; block++)
+    {
+        if (block == 0 && split)
+        {
+            // as in processBlock: render up to the event, send it, render the rest
+            instrlib_render(instrlib, left, right, eventFrame, 1.0f, false);
+            instrlib_shortMessage(instrlib, 0x90, note, 100);
+            instrlib_render(instrlib, left + eventFrame, right + eventFrame, blockSize - eventFrame, 1.0f, false);
+        }
+        else
+        {
+            if (block == 0)
+            {
+                instrlib_shortMessage(instrlib, 0x90, note, 100);
+            }
+            instrlib_render(instrlib, left, right, blockSize, 1.0f, false);
+        }
+        for (int frame = 0; frame < blockSize; frame++)
+        {
+            if (fabsf(left[frame]) > threshold || fabsf(right[frame]) > threshold)
+            {
+                onset = block * blockSize + frame;
+                break;
+            }
+        }
+    }
+    instrlib_destroy(instrlib);
+    return onset;
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    int blockSize = 1024;
+    int note = 60;
+    float thresholdDb = -60;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:n:t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'b':
+            blockSize = atoi(optarg);
+            break;
+        case 'n':
+            note = atoi(optarg);
+            break;
+        case 't':
+            thresholdDb = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || samplerate <= 0 || blockSize < 1 || blockSize > MAX_BLOCK_SIZE || note < 0 || note > 127)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    const float threshold = powf(10.0f, thresholdDb / 20.0f);
+
+    int reference = render_onset(samplerate, blockSize, note, 0, 1, threshold);
+    if (reference < 0)
+    {
+        fprintf(stderr, "note %d never crossed %.1f dBFS\n", note, thresholdDb);
+        return 1;
+    }
+    printf("reference onset %d frames after the event\n", reference);
+
+    int splitMax = 0, blockMax = 0;
+    double splitSum = 0, blockSum = 0;
+    for (int eventFrame = 0; eventFrame < blockSize; eventFrame++)
+    {
+        int expected = eventFrame + reference;
+        int splitError = abs(render_onset(samplerate, blockSize, note, eventFrame, 1, threshold) - expected);
+        int blockError = abs(render_onset(samplerate, blockSize, note, eventFrame, 0, threshold) - expected);
+        splitSum += splitError;
+        blockSum += blockError;
+        splitMax = splitError > splitMax ? splitError : splitMax;
+        blockMax = blockError > blockMax ? blockError : blockMax;
+    }
+    printf("%-26s %12s %12s %12s\n", "scheduling", "mean frames", "max frames", "max ms");
+    printf("%-26s %12.2f %12d %12.3f\n", "split at event", splitSum / blockSize, splitMax,
+           splitMax * 1000.0 / samplerate);
+    printf("%-26s %12.2f %12d %12.3f\n", "event at block start", blockSum / blockSize, blockMax,
+           blockMax * 1000.0 / samplerate);
+    return splitMax > 1;
+}
@@ -0,0 +1,114 @@
+# Profile guided build of instrlib, included by CMakeLists.txt when INSTRLIB_PGO is on.
+#
+# instrlib_instrumented is trained by rendering the song compiled into the synth
+# with songrender, llvm-profdata merges the profiles into instrlib.profdata and
+# instrlib_pgo is rebuilt with it. instrlib_baseline is the same library built
+# like build.sh builds it, and the instrlib_pgo_report target benchmarks the two
+# against each other into pgo_report.txt:
+#
+#   cmake -B build -DINSTRLIB_PGO=ON && cmake --build build --target instrlib_pgo_report
+
+if(NOT CMAKE_C_COMPILER_ID MATCHES "Clang")
+    message(FATAL_ERROR "INSTRLIB_PGO needs clang, the C compiler is ${CMAKE_C_COMPILER_ID}")
+endif()
+
+set(WASM2C "/opt/homebrew/Cellar/wabt/1.0.34/share/wabt/wasm2c" CACHE PATH "wabt's wasm2c directory, with wasm-rt.h and wasm-rt-impl.c")
+
+find_program(LLVM_PROFDATA llvm-profdata)
+if(NOT LLVM_PROFDATA AND APPLE)
+    execute_process(COMMAND xcrun -f llvm-profdata OUTPUT_VARIABLE LLVM_PROFDATA OUTPUT_STRIP_TRAILING_WHITESPACE)
+endif()
+if(NOT LLVM_PROFDATA)
+    message(FATAL_ERROR "INSTRLIB_PGO needs llvm-profdata")
+endif()
+
+set(INSTRLIB_SOURCES
+    instruments.c
+    instrlib.c
+    instrlib_memory.c
+    instrlib_template.c
+    renderengine.c
+    seekindex.c
+    ${WASM2C}/wasm-rt-impl.c)
+
+# instrlib_memory.c replaces the runtime's allocator, as in build.sh
+set_source_files_properties(${WASM2C}/wasm-rt-impl.c PROPERTIES COMPILE_DEFINITIONS
+    "wasm_rt_allocate_memory=wasm_rt_impl_allocate_memory;wasm_rt_grow_memory=wasm_rt_impl_grow_memory;wasm_rt_free_memory=wasm_rt_impl_free_memory")
+
+# instrlib_<name> with songrender_<name> and membench_<name> linked against it, built from INSTRLIB_SOURCES
+# unless SOURCES are given
+function(add_instrlib_variant name)
+    cmake_parse_arguments(VARIANT "" "" "SOURCES;COMPILE_OPTIONS;LINK_OPTIONS" ${ARGN})
+    if(NOT VARIANT_SOURCES)
+        set(VARIANT_SOURCES ${INSTRLIB_SOURCES})
+    endif()
+    add_library(instrlib_${name} STATIC ${VARIANT_SOURCES})
+    # it ends up in the plugin
+    set_target_properties(instrlib_${name} PROPERTIES POSITION_INDEPENDENT_CODE ON)
+    target_include_directories(instrlib_${name} PUBLIC ${CMAKE_CURRENT_SOURCE_DIR} ${WASM2C})
+    target_compile_definitions(instrlib_${name} PRIVATE WASM_RT_MEMCHECK_GUARD_PAGES=1)
+    target_compile_options(instrlib_${name} PRIVATE -O3 ${VARIANT_COMPILE_OPTIONS})
+    target_link_options(instrlib_${name} INTERFACE ${VARIANT_LINK_OPTIONS})
+    target_link_libraries(instrlib_${name} INTERFACE m pthread)
+    foreach(tool songrender membench)
+        add_executable(${tool}_${name} ${tool}.c)
+        target_compile_options(${tool}_${name} PRIVATE -O3)
+        target_link_libraries(${tool}_${name} PRIVATE instrlib_${name})
+    endforeach()
+endfunction()
+
+add_instrlib_variant(baseline)
+add_instrlib_variant(instrumented
+    COMPILE_OPTIONS -fprofile-instr-generate
+    LINK_OPTIONS -fprofile-instr-generate)
+
+# the training workload is the whole song at the two common samplerates, with the tail
+set(INSTRLIB_PROFDATA ${CMAKE_CURRENT_BINARY_DIR}/instrlib.profdata)
+add_custom_command(OUTPUT ${INSTRLIB_PROFDATA}
+    COMMAND ${CMAKE_COMMAND} -E remove -f pgo-44100.profraw pgo-48000.profraw
+    COMMAND ${CMAKE_COMMAND} -E env LLVM_PROFILE_FILE=pgo-44100.profraw
+        $<TARGET_FILE:songrender_instrumented> -r 44100 -t 3000 pgo-train.wav
+    COMMAND ${CMAKE_COMMAND} -E env LLVM_PROFILE_FILE=pgo-48000.profraw
+        $<TARGET_FILE:songrender_instrumented> -r 48000 -t 3000 pgo-train.wav
+    COMMAND ${LLVM_PROFDATA} merge -output=${INSTRLIB_PROFDATA} pgo-44100.profraw pgo-48000.profraw
+    DEPENDS songrender_instrumented
+    WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+    COMMENT "Training instrlib on the song"
+    VERBATIM)
+add_custom_target(instrlib_profile DEPENDS ${INSTRLIB_PROFDATA})
+
+# The PGO build compiles wrappers that include the sources, so that its objects alone are rebuilt when the
+# profile changes: source file properties such as OBJECT_DEPENDS apply to every target that compiles the file
+set(INSTRLIB_PGO_SOURCES)
+foreach(source ${INSTRLIB_SOURCES})
+    get_filename_component(path ${source} ABSOLUTE)
+    get_filename_component(name ${source} NAME)
+    set(wrapper ${CMAKE_CURRENT_BINARY_DIR}/pgo/${name})
+    file(GENERATE OUTPUT ${wrapper} CONTENT "#include \"${path}\"\n")
+    list(APPEND INSTRLIB_PGO_SOURCES ${wrapper})
+endforeach()
+set_source_files_properties(${INSTRLIB_PGO_SOURCES} PROPERTIES GENERATED TRUE OBJECT_DEPENDS ${INSTRLIB_PROFDATA})
+set_source_files_properties(${CMAKE_CURRENT_BINARY_DIR}/pgo/wasm-rt-impl.c PROPERTIES COMPILE_DEFINITIONS
+    "wasm_rt_allocate_memory=wasm_rt_impl_allocate_memory;wasm_rt_grow_memory=wasm_rt_impl_grow_memory;wasm_rt_free_memory=wasm_rt_impl_free_memory")
+
+if(INSTRLIB_PGO_LTO)
+    set(INSTRLIB_LTO -flto=thin)
+endif()
+add_instrlib_variant(pgo
+    SOURCES ${INSTRLIB_PGO_SOURCES}
+    COMPILE_OPTIONS -fprofile-instr-use=${INSTRLIB_PROFDATA} -Wno-profile-instr-unprofiled ${INSTRLIB_LTO}
+    LINK_OPTIONS ${INSTRLIB_LTO})
+add_dependencies(instrlib_pgo instrlib_profile)
+
+add_custom_target(instrlib_pgo_report
+    COMMAND ${CMAKE_COMMAND}
+        -DBASELINE_SONGRENDER=$<TARGET_FILE:songrender_baseline>
+        -DPGO_SONGRENDER=$<TARGET_FILE:songrender_pgo>
+        -DBASELINE_MEMBENCH=$<TARGET_FILE:membench_baseline>
+        -DPGO_MEMBENCH=$<TARGET_FILE:membench_pgo>
+        -DREPORT=${CMAKE_CURRENT_BINARY_DIR}/pgo_report.txt
+        -P ${CMAKE_CURRENT_SOURCE_DIR}/pgo_report.cmake
+    DEPENDS songrender_baseline songrender_pgo membench_baseline membench_pgo
+    WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+    COMMENT "Benchmarking instrlib with and without PGO"
+    VERBATIM)
@@ -0,0 +1,48 @@
+# Runs the baseline and PGO builds of songrender and membench and writes the
+# comparison to REPORT, see pgo.cmake. Each figure is the best of RUNS runs.
+
+set(RUNS 3)
+
+# realtime factor of the fastest of RUNS full song renders
+function(best_realtime songrender result)
+    set(best 0)
+    foreach(run RANGE 1 ${RUNS})
+        execute_process(COMMAND ${songrender} pgo-report.wav ERROR_VARIABLE output RESULT_VARIABLE status)
+        if(NOT status EQUAL 0)
+            message(FATAL_ERROR "${songrender} failed: ${output}")
+        endif()
+        string(REGEX MATCH "([0-9.]+)x realtime" match "${output}")
+        if(CMAKE_MATCH_1 GREATER best)
+            set(best ${CMAKE_MATCH_1})
+        endif()
+    endforeach()
+    set(${result} ${best} PARENT_SCOPE)
+endfunction()
+
+# ns/sample and worst quantum of membench's reserved+precommit row, the backend WasmSynth uses
+function(membench_row membench nsResult worstResult output)
+    execute_process(COMMAND ${membench} -n ${RUNS} -d 10 OUTPUT_VARIABLE text RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${membench} failed")
+    endif()
+    string(REGEX MATCH "\nreserved\\+precommit +[^ ]+ +[0-9.]+ +([0-9.]+) +([0-9.]+)" match "${text}")
+    set(${nsResult} ${CMAKE_MATCH_1} PARENT_SCOPE)
+    set(${worstResult} ${CMAKE_MATCH_2} PARENT_SCOPE)
+    set(${output} "${text}" PARENT_SCOPE)
+endfunction()
+
+best_realtime(${BASELINE_SONGRENDER} baselineRealtime)
+best_realtime(${PGO_SONGRENDER} pgoRealtime)
+membench_row(${BASELINE_MEMBENCH} baselineNs baselineWorst baselineMembench)
+membench_row(${PGO_MEMBENCH} pgoNs pgoWorst pgoMembench)
+file(REMOVE pgo-report.wav)
+
+set(report "instrlib PGO report\n\n")
+string(APPEND report "                          baseline          pgo\n")
+string(APPEND report "song render realtime x    ${baselineRealtime}          ${pgoRealtime}\n")
+string(APPEND report "ns/sample                 ${baselineNs}          ${pgoNs}\n")
+string(APPEND report "worst quantum us          ${baselineWorst}          ${pgoWorst}\n")
+string(APPEND report "\nbaseline membench:\n${baselineMembench}\npgo membench:\n${pgoMembench}")
+file(WRITE ${REPORT} "${report}")
+message("${report}")
+message("Report written to ${REPORT}")
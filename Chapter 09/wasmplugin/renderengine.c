@@ -0,0 +1,456 @@
+#include "./renderengine.h"
+#include "./mixkernels.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#else
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#endif
+
+#define QUANTUM_FRAMES 128
+#define CACHE_LINE_FLOATS 16
+// how long a worker spins for the next block before it goes to sleep
+#define SPIN_NANOS 200000
+
+/*
+ * Workers that did not get a block within SPIN_NANOS sleep on a semaphore.
+ * Posting it never blocks the caller, and only makes a system call when a
+ * worker is actually asleep.
+ */
+#ifdef __APPLE__
+typedef dispatch_semaphore_t wakeup_t;
+
+static bool wakeup_init(wakeup_t *wakeup)
+{
+    *wakeup = dispatch_semaphore_create(0);
+    return *wakeup != NULL;
+}
+
+static void wakeup_destroy(wakeup_t *wakeup)
+{
+    dispatch_release(*wakeup);
+}
+
+static void wakeup_post(wakeup_t *wakeup)
+{
+    dispatch_semaphore_signal(*wakeup);
+}
+
+static void wakeup_wait(wakeup_t *wakeup)
+{
+    dispatch_semaphore_wait(*wakeup, DISPATCH_TIME_FOREVER);
+}
+#else
+typedef sem_t wakeup_t;
+
+static bool wakeup_init(wakeup_t *wakeup)
+{
+    return sem_init(wakeup, 0, 0) == 0;
+}
+
+static void wakeup_destroy(wakeup_t *wakeup)
+{
+    sem_destroy(wakeup);
+}
+
+static void wakeup_post(wakeup_t *wakeup)
+{
+    sem_post(wakeup);
+}
+
+static void wakeup_wait(wakeup_t *wakeup)
+{
+    while (sem_wait(wakeup) != 0 && errno == EINTR)
+    {
+    }
+}
+#endif
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static int64_t now_nanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct
+{
+    instrlib_t *instrlib;
+    float *left;
+    float *right;
+    float gain_left;
+    float gain_right;
+} track_t;
+
+struct renderengine
+{
+    track_t *tracks;
+    int num_tracks;
+    int max_block_frames;
+    float *trackbuffers;
+
+    pthread_t *workers;
+    int num_workers;
+    unsigned int flags;
+    // only touched by the thread that renders
+    bool priority_adopted;
+    atomic_int num_realtime_workers;
+
+    /*
+     * The per block barrier. The caller publishes a block by resetting
+     * next_track and bumping generation, every thread including the caller
+     * takes tracks from next_track, and the caller spins until tracks_done
+     * has counted them all. A worker that wakes up late finds no tracks left
+     * and goes back to waiting, so nobody waits for a worker that is not
+     * rendering.
+     */
+    atomic_uint generation;
+    atomic_int next_track;
+    atomic_int tracks_done;
+    atomic_bool quit;
+    // written before next_track is reset, only read by a thread that then takes a track
+    int block_frames;
+
+    // workers that are asleep or about to be, the caller posts wakeup once for each
+    atomic_int sleepers;
+    wakeup_t wakeup;
+    bool has_wakeup;
+};
+
+static void render_track(track_t *track, int num_frames)
+{
+    instrlib_render(track->instrlib, track->left, track->right, num_frames, 1.0f, false);
+}
+
+// Tracks are handed out one at a time, so a slow track does not hold back a whole thread's share
+static void render_tracks(renderengine_t *engine)
+{
+    int track;
+    while ((track = atomic_fetch_add_explicit(&engine->next_track, 1, memory_order_acq_rel)) < engine->num_tracks)
+    {
+        render_track(&engine->tracks[track], engine->block_frames);
+        atomic_fetch_add_explicit(&engine->tracks_done, 1, memory_order_release);
+    }
+}
+
+/*
+ * Gives the workers the scheduling of the thread that renders, which is the
+ * audio thread: its time constraint policy on macOS, its SCHED_FIFO or
+ * SCHED_RR priority elsewhere. They never run above the host's own audio
+ * threads that way, and stay at normal priority when the caller does.
+ */
+static void adopt_caller_priority(renderengine_t *engine)
+{
+    int num_realtime = 0;
+#ifdef __APPLE__
+    thread_time_constraint_policy_data_t policy;
+    mach_msg_type_number_t count = THREAD_TIME_CONSTRAINT_POLICY_COUNT;
+    boolean_t is_default = true;
+    if (thread_policy_get(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY,
+                          (thread_policy_t)&policy, &count, &is_default) == KERN_SUCCESS
+        && !is_default)
+    {
+        for (int n = 0; n < engine->num_workers; n++)
+        {
+            num_realtime += thread_policy_set(pthread_mach_thread_np(engine->workers[n]), THREAD_TIME_CONSTRAINT_POLICY,
+                                              (thread_policy_t)&policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT)
+                            == KERN_SUCCESS;
+        }
+    }
+#else
+    int policy;
+    struct sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0 && (policy == SCHED_FIFO || policy == SCHED_RR))
+    {
+        for (int n = 0; n < engine->num_workers; n++)
+        {
+            num_realtime += pthread_setschedparam(engine->workers[n], policy, &param) == 0;
+        }
+    }
+#endif
+    atomic_store_explicit(&engine->num_realtime_workers, num_realtime, memory_order_relaxed);
+}
+
+/* Returns the generation of the next block, spinning for a while before going to sleep */
+static unsigned wait_for_block(renderengine_t *engine, unsigned seen_generation)
+{
+    const int64_t spin_until = now_nanos() + SPIN_NANOS;
+    for (int spins = 0;; spins++)
+    {
+        unsigned generation = atomic_load_explicit(&engine->generation, memory_order_acquire);
+        if (generation != seen_generation)
+        {
+            return generation;
+        }
+        if ((spins & 63) != 63 || now_nanos() < spin_until)
+        {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&engine->sleepers, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&engine->generation, memory_order_seq_cst) != seen_generation)
+        {
+            // take the announcement back, unless the caller has counted it already and posts for it
+            int sleepers = atomic_load_explicit(&engine->sleepers, memory_order_relaxed);
+            while (sleepers > 0 && !atomic_compare_exchange_weak_explicit(&engine->sleepers, &sleepers, sleepers - 1,
+                                                                          memory_order_relaxed, memory_order_relaxed))
+            {
+            }
+            if (sleepers > 0)
+            {
+                continue;
+            }
+        }
+        wakeup_wait(&engine->wakeup);
+    }
+}
+
+/* The caller's side of wait_for_block */
+static void start_block(renderengine_t *engine)
+{
+    atomic_fetch_add_explicit(&engine->generation, 1, memory_order_seq_cst);
+    for (int sleepers = atomic_exchange_explicit(&engine->sleepers, 0, memory_order_seq_cst); sleepers > 0; sleepers--)
+    {
+        wakeup_post(&engine->wakeup);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    renderengine_t *engine = arg;
+    unsigned seen_generation = 0;
+    for (;;)
+    {
+        seen_generation = wait_for_block(engine, seen_generation);
+        if (atomic_load_explicit(&engine->quit, memory_order_acquire))
+        {
+            break;
+        }
+        render_tracks(engine);
+    }
+    instrlib_thread_free();
+    return NULL;
+}
+
+renderengine_t *renderengine_create(int num_tracks, int num_threads, float samplerate, int max_block_frames)
+{
+    return renderengine_create_with_flags(num_tracks, num_threads, samplerate, max_block_frames, 0);
+}
+
+/* Everything renderengine_create_with_flags got before it failed, or all of it once the workers are gone */
+static void free_engine(renderengine_t *engine)
+{
+    if (engine->tracks != NULL)
+    {
+        for (int n = 0; n < engine->num_tracks; n++)
+        {
+            instrlib_destroy(engine->tracks[n].instrlib);
+        }
+    }
+    if (engine->has_wakeup)
+    {
+        wakeup_destroy(&engine->wakeup);
+    }
+    free(engine->workers);
+    free(engine->trackbuffers);
+    free(engine->tracks);
+    free(engine);
+}
+
+static void stop_workers(renderengine_t *engine)
+{
+    atomic_store_explicit(&engine->quit, true, memory_order_release);
+    start_block(engine);
+    for (int n = 0; n < engine->num_workers; n++)
+    {
+        pthread_join(engine->workers[n], NULL);
+    }
+}
+
+renderengine_t *renderengine_create_with_flags(int num_tracks, int num_threads, float samplerate, int max_block_frames,
+                                               unsigned int flags)
+{
+    if (num_tracks < 0 || max_block_frames <= 0)
+    {
+        return NULL;
+    }
+    if (num_threads <= 0)
+    {
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads > num_tracks)
+    {
+        num_threads = num_tracks > 0 ? num_tracks : 1;
+    }
+    // whole quanta keep every track buffer on its own cache lines
+    max_block_frames = (max_block_frames + QUANTUM_FRAMES - 1) / QUANTUM_FRAMES * QUANTUM_FRAMES;
+
+    renderengine_t *engine = calloc(1, sizeof(renderengine_t));
+    if (engine == NULL)
+    {
+        return NULL;
+    }
+    engine->num_tracks = num_tracks;
+    engine->max_block_frames = max_block_frames;
+    engine->flags = flags;
+    engine->tracks = calloc(num_tracks > 0 ? num_tracks : 1, sizeof(track_t));
+    engine->trackbuffers = aligned_alloc(CACHE_LINE_FLOATS * sizeof(float),
+                                         (size_t)num_tracks * 2 * max_block_frames * sizeof(float));
+    engine->workers = calloc(num_threads, sizeof(pthread_t));
+    if (engine->tracks == NULL || (engine->trackbuffers == NULL && num_tracks > 0) || engine->workers == NULL)
+    {
+        free_engine(engine);
+        return NULL;
+    }
+
+    for (int n = 0; n < num_tracks; n++)
+    {
+        track_t *track = &engine->tracks[n];
+        track->instrlib = instrlib_create(samplerate);
+        if (track->instrlib == NULL)
+        {
+            free_engine(engine);
+            return NULL;
+        }
+        track->left = engine->trackbuffers + (size_t)n * 2 * max_block_frames;
+        track->right = track->left + max_block_frames;
+        track->gain_left = 1.0f;
+        track->gain_right = 1.0f;
+    }
+
+    engine->has_wakeup = wakeup_init(&engine->wakeup);
+    if (!engine->has_wakeup)
+    {
+        free_engine(engine);
+        return NULL;
+    }
+
+    for (int n = 0; n < num_threads - 1; n++)
+    {
+        if (pthread_create(&engine->workers[n], NULL, worker_main, engine) != 0)
+        {
+            stop_workers(engine);
+            free_engine(engine);
+            return NULL;
+        }
+        engine->num_workers++;
+    }
+    return engine;
+}
+
+void renderengine_destroy(renderengine_t *engine)
+{
+    if (engine == NULL)
+    {
+        return;
+    }
+    stop_workers(engine);
+    free_engine(engine);
+}
+
+int renderengine_getNumTracks(const renderengine_t *engine)
+{
+    return engine->num_tracks;
+}
+
+int renderengine_getNumThreads(const renderengine_t *engine)
+{
+    return engine->num_workers + 1;
+}
+
+int renderengine_getNumRealtimeWorkers(const renderengine_t *engine)
+{
+    return atomic_load_explicit(&((renderengine_t *)engine)->num_realtime_workers, memory_order_relaxed);
+}
+
+instrlib_t *renderengine_getTrack(renderengine_t *engine, int track)
+{
+    return engine->tracks[track].instrlib;
+}
+
+void renderengine_setTrackGainPan(renderengine_t *engine, int track, float gain, float pan)
+{
+    if (pan < -1.0f)
+    {
+        pan = -1.0f;
+    }
+    else if (pan > 1.0f)
+    {
+        pan = 1.0f;
+    }
+    // balance law: the center leaves both channels at unity, panning attenuates the other side
+    engine->tracks[track].gain_left = gain * (pan > 0.0f ? 1.0f - pan : 1.0f);
+    engine->tracks[track].gain_right = gain * (pan < 0.0f ? 1.0f + pan : 1.0f);
+}
+
+static void render_block(renderengine_t *engine, float *left, float *right, int num_frames)
+{
+    engine->block_frames = num_frames;
+    atomic_store_explicit(&engine->tracks_done, 0, memory_order_relaxed);
+    atomic_store_explicit(&engine->next_track, 0, memory_order_release);
+    if (engine->num_workers > 0)
+    {
+        start_block(engine);
+    }
+
+    render_tracks(engine);
+    while (atomic_load_explicit(&engine->tracks_done, memory_order_acquire) < engine->num_tracks)
+    {
+        cpu_relax();
+    }
+
+    if (engine->num_tracks == 0)
+    {
+        memset(left, 0, num_frames * sizeof(float));
+        memset(right, 0, num_frames * sizeof(float));
+        return;
+    }
+    const track_t *first = &engine->tracks[0];
+    mix_copy_gain(left, first->left, first->gain_left, num_frames);
+    mix_copy_gain(right, first->right, first->gain_right, num_frames);
+    for (int n = 1; n < engine->num_tracks; n++)
+    {
+        const track_t *track = &engine->tracks[n];
+        mix_accumulate_gain(left, track->left, track->gain_left, num_frames);
+        mix_accumulate_gain(right, track->right, track->gain_right, num_frames);
+    }
+}
+
+void renderengine_render(renderengine_t *engine, float *left, float *right, int num_frames)
+{
+    if ((engine->flags & RENDERENGINE_REALTIME) && !engine->priority_adopted)
+    {
+        adopt_caller_priority(engine);
+        engine->priority_adopted = true;
+    }
+    for (int pos = 0; pos < num_frames; pos += engine->max_block_frames)
+    {
+        int block_frames = num_frames - pos;
+        if (block_frames > engine->max_block_frames)
+        {
+            block_frames = engine->max_block_frames;
+        }
+        render_block(engine, left + pos, right + pos, block_frames);
+    }
+}
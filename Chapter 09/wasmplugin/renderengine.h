@@ -0,0 +1,64 @@
+#ifndef RENDERENGINE_H
+#define RENDERENGINE_H
+
+#include "instrlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Renders a number of synth tracks in parallel on a pool of worker threads and
+ * mixes them down to one planar stereo output. Every track is its own
+ * instrlib_t, so MIDI for a track is sent with instrlib_shortMessage on the
+ * handle returned by renderengine_getTrack.
+ *
+ * The engine is driven from a single thread. Track handles, gains and pans may
+ * only be touched between calls to renderengine_render, never during one.
+ *
+ * Workers meet the calling thread at a lock-free barrier once per block: the
+ * caller never waits on a lock or a condition, it renders tracks itself and
+ * spins until the last one is done. Workers spin for the next block for a
+ * while and then sleep until the caller posts a semaphore, which does not
+ * block it. That makes the engine usable from an audio callback.
+ */
+typedef struct renderengine renderengine_t;
+
+/*
+ * num_threads counts the calling thread, so 1 renders everything serially on
+ * the caller. 0 picks one thread per online CPU. max_block_frames is the
+ * largest block the engine renders at once, longer renders are split, and
+ * must be at least 1. Returns NULL when the arguments are out of range or
+ * memory, an instance or a worker thread could not be created.
+ */
+renderengine_t *renderengine_create(int num_tracks, int num_threads, float samplerate, int max_block_frames);
+
+/*
+ * The first renderengine_render gives the workers the realtime scheduling of
+ * the thread that calls it, normally the audio thread, with a system call per
+ * worker. Workers never run above that thread, and keep their normal priority
+ * when it is not realtime or the OS refuses.
+ */
+#define RENDERENGINE_REALTIME 0x1
+
+renderengine_t *renderengine_create_with_flags(int num_tracks, int num_threads, float samplerate, int max_block_frames,
+                                               unsigned int flags);
+void renderengine_destroy(renderengine_t *engine);
+
+int renderengine_getNumTracks(const renderengine_t *engine);
+int renderengine_getNumThreads(const renderengine_t *engine);
+/* Workers that actually got realtime priority, 0 until the first renderengine_render */
+int renderengine_getNumRealtimeWorkers(const renderengine_t *engine);
+instrlib_t *renderengine_getTrack(renderengine_t *engine, int track);
+
+/* pan goes from -1 (left) through 0 (center, unity) to 1 (right) */
+void renderengine_setTrackGainPan(renderengine_t *engine, int track, float gain, float pan);
+
+/* Renders num_frames frames of all tracks and writes the mix to left/right. */
+void renderengine_render(renderengine_t *engine, float *left, float *right, int num_frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
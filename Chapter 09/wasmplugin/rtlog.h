@@ -0,0 +1,180 @@
+#ifndef RTLOG_H
+#define RTLOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Logging for the audio thread. Each RtLog is a fixed size single producer,
+ * single consumer queue of records that holds a format string literal and up
+ * to four int arguments. Logging only stores a record, it never locks,
+ * allocates or makes a system call. A background drainer thread shared by
+ * all RtLogs formats the records to stdout and reports records that were
+ * dropped because the queue was full.
+ *
+ * One RtLog belongs to one producer, e.g. one audio callback. Create and
+ * destroy it outside the audio thread.
+ */
+class RtLog
+{
+public:
+    explicit RtLog(const char *name, uint32_t capacity = 1024)
+        : name(name), records(roundUpToPowerOfTwo(capacity)), mask((uint32_t)records.size() - 1)
+    {
+        Drainer::get().add(this);
+    }
+
+    ~RtLog()
+    {
+        Drainer::get().remove(this);
+    }
+
+    /* Only %d style conversions are supported, the arguments are ints */
+    void log(const char *format, int arg0 = 0, int arg1 = 0, int arg2 = 0, int arg3 = 0) noexcept
+    {
+        const uint32_t write = writePosition.load(std::memory_order_relaxed);
+        if (write - readPosition.load(std::memory_order_acquire) == records.size())
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        records[write & mask] = {format, {arg0, arg1, arg2, arg3}};
+        writePosition.store(write + 1, std::memory_order_release);
+    }
+
+    uint64_t getNumDropped() const noexcept
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Record
+    {
+        const char *format;
+        int args[4];
+    };
+
+    static uint32_t roundUpToPowerOfTwo(uint32_t capacity)
+    {
+        uint32_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    // drainer thread only
+    void drain()
+    {
+        uint32_t read = readPosition.load(std::memory_order_relaxed);
+        const uint32_t write = writePosition.load(std::memory_order_acquire);
+        for (; read != write; read++)
+        {
+            const Record &record = records[read & mask];
+            std::printf("%s: ", name);
+            std::printf(record.format, record.args[0], record.args[1], record.args[2], record.args[3]);
+            std::putchar('\n');
+        }
+        readPosition.store(read, std::memory_order_release);
+
+        const uint64_t numDropped = dropped.load(std::memory_order_relaxed);
+        if (numDropped != reportedDropped)
+        {
+            std::printf("%s: %llu log records dropped\n", name, (unsigned long long)(numDropped - reportedDropped));
+            reportedDropped = numDropped;
+        }
+        std::fflush(stdout);
+    }
+
+    /*
+     * The thread runs while there are logs to drain, it is started by the
+     * first and joined when the last one is removed. The drainer itself is
+     * never destroyed, so nothing is left to do at unload or exit, when the
+     * host may have torn down threads already.
+     */
+    class Drainer
+    {
+    public:
+        static Drainer &get()
+        {
+            static Drainer &drainer = *new Drainer;
+            return drainer;
+        }
+
+        void add(RtLog *log)
+        {
+            std::lock_guard<std::mutex> running(lifecycle);
+            std::lock_guard<std::mutex> lock(mutex);
+            logs.push_back(log);
+            if (!thread.joinable())
+            {
+                stopping = false;
+                thread = std::thread([this] { run(); });
+            }
+        }
+
+        void remove(RtLog *log)
+        {
+            std::lock_guard<std::mutex> running(lifecycle);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                // whatever is still queued gets printed before the log goes away
+                log->drain();
+                for (size_t n = 0; n < logs.size(); n++)
+                {
+                    if (logs[n] == log)
+                    {
+                        logs.erase(logs.begin() + n);
+                        break;
+                    }
+                }
+                if (!logs.empty())
+                {
+                    return;
+                }
+                stopping = true;
+            }
+            wakeup.notify_one();
+            thread.join();
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping)
+            {
+                for (RtLog *log : logs)
+                {
+                    log->drain();
+                }
+                wakeup.wait_for(lock, std::chrono::milliseconds(20));
+            }
+        }
+
+        // held while the thread is started or stopped, so an add waits for a stopping thread to be joined
+        std::mutex lifecycle;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::vector<RtLog *> logs;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    const char *name;
+    std::vector<Record> records;
+    const uint32_t mask;
+    std::atomic<uint32_t> writePosition{0};
+    std::atomic<uint32_t> readPosition{0};
+    std::atomic<uint64_t> dropped{0};
+    uint64_t reportedDropped = 0;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include "./seekindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Checks that seekindex_seek reaches exactly the state of linear playback.
+ * For every target the output that follows a seek is compared bit for bit
+ * with the output of a fresh instance that played the song from the start.
+ * One instance does all the seeks, backwards and forwards, so restores also
+ * start from the state a previous seek left behind. The targets cover a
+ * checkpoint itself, both sides of a keyframe (every 16th checkpoint) and the
+ * stretch after the last checkpoint. Exits non-zero when a check fails.
+ */
+
+#define QUANTUM_FRAMES 128
+#define COMPARE_QUANTA 256
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-i intervalmillis]\n"
+            "  compares seeks through a seek index with playing the song from the start\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -i  checkpoint interval in milliseconds (default 1000)\n",
+            name);
+}
+
+/* The song as playback renders it after the clock has reached millis, as seekindex_seek leaves it */
+static void play_to(instrlib_t *instrlib, double millis, double quantumMillis)
+{
+    while (instrlib_getCurrentTimeMillis(instrlib) + quantumMillis <= millis)
+    {
+        instrlib_playEventsAndFillSampleBuffer(instrlib);
+    }
+}
+
+static void render(instrlib_t *instrlib, float *output)
+{
+    for (int quantum = 0; quantum < COMPARE_QUANTA; quantum++)
+    {
+        instrlib_playEventsAndFillSampleBuffer(instrlib);
+        memcpy(output + quantum * 2 * QUANTUM_FRAMES, instrlib_getSampleBuffer(instrlib), 2 * QUANTUM_FRAMES * sizeof(float));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    double intervalMillis = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:i:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'i':
+            intervalMillis = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || samplerate <= 0 || intervalMillis <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    const double quantumMillis = 128000.0 / (double)samplerate;
+
+    seekindex_t *index = seekindex_create(samplerate, intervalMillis);
+    instrlib_t *seeking = instrlib_create(samplerate);
+    if (index == NULL || seeking == NULL)
+    {
+        fprintf(stderr, "could not create the seek index or an instance\n");
+        return 1;
+    }
+    seekindex_prepass(index);
+    const int numCheckpoints = seekindex_getNumCheckpoints(index);
+    const double durationMillis = instrlib_getDuration(seeking);
+    printf("%d checkpoints every %g ms, %zu bytes, song %.0f ms\n", numCheckpoints, intervalMillis,
+           seekindex_getMemoryUsage(index), durationMillis);
+    if (numCheckpoints < 2)
+    {
+        fprintf(stderr, "the song is too short to check seeking between checkpoints\n");
+        return 1;
+    }
+
+    const double lastCheckpoint = (numCheckpoints - 1) * intervalMillis;
+    const double keyframe = numCheckpoints > 16 ? 16 * intervalMillis : lastCheckpoint;
+    const double targets[] = {
+        lastCheckpoint + (durationMillis - lastCheckpoint) / 2,
+        keyframe - quantumMillis / 2,
+        intervalMillis * 2.5,
+        keyframe,
+        keyframe + intervalMillis * 0.1,
+        keyframe + intervalMillis * 1.7,
+        0,
+        lastCheckpoint + 0.3,
+        intervalMillis * 0.4,
+        durationMillis,
+    };
+
+    float *expected = malloc(COMPARE_QUANTA * 2 * QUANTUM_FRAMES * sizeof(float));
+    float *actual = malloc(COMPARE_QUANTA * 2 * QUANTUM_FRAMES * sizeof(float));
+    int numFailed = 0;
+    for (size_t n = 0; n < sizeof(targets) / sizeof(targets[0]); n++)
+    {
+        const double millis = targets[n];
+        instrlib_t *linear = instrlib_create(samplerate);
+        play_to(linear, millis, quantumMillis);
+        render(linear, expected);
+        const double linearMillis = instrlib_getCurrentTimeMillis(linear);
+        instrlib_destroy(linear);
+
+        const int rendered = seekindex_seek(index, seeking, millis);
+        render(seeking, actual);
+        const bool passed = rendered >= 0 && instrlib_getCurrentTimeMillis(seeking) == linearMillis &&
+                            memcmp(expected, actual, COMPARE_QUANTA * 2 * QUANTUM_FRAMES * sizeof(float)) == 0;
+        printf("%s: seek to %.3f ms, %d quanta rendered after the checkpoint\n", passed ? "ok" : "FAILED", millis,
+               rendered);
+        numFailed += passed ? 0 : 1;
+    }
+
+    free(actual);
+    free(expected);
+    instrlib_destroy(seeking);
+    seekindex_destroy(index);
+    return numFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+#include "./seekindex.h"
+#include "./instrlib_internal.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE 4096
+#define KEYFRAME_INTERVAL 16
+#define QUANTUM_FRAMES 128
+
+typedef struct
+{
+    double millis;
+    unsigned char globals[INSTRLIB_GLOBALS_SIZE];
+    uint64_t pages;
+    uint32_t numBlocks;
+    uint32_t *blockIndexes;
+    unsigned char *blocks;
+} checkpoint_t;
+
+struct seekindex
+{
+    float samplerate;
+    double intervalMillis;
+    double quantumMillis;
+
+    checkpoint_t *checkpoints;
+    int capacity;
+    atomic_int count;
+    atomic_size_t memoryUsage;
+
+    // linear memory as of the last recorded checkpoint, only touched by the recording thread
+    unsigned char *shadow;
+    uint64_t shadowSize;
+};
+
+static const unsigned char zeroblock[BLOCK_SIZE];
+
+seekindex_t *seekindex_create(float samplerate, double intervalMillis)
+{
+    instrlib_t *instrlib = instrlib_create(samplerate);
+    if (instrlib == NULL)
+    {
+        return NULL;
+    }
+    double durationMillis = instrlib_getDuration(instrlib);
+    instrlib_destroy(instrlib);
+
+    seekindex_t *index = calloc(1, sizeof(seekindex_t));
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    index->samplerate = samplerate;
+    // same expression as the module uses for advancing its clock
+    index->quantumMillis = 128000.0 / (double)samplerate;
+    index->intervalMillis = intervalMillis > index->quantumMillis ? intervalMillis : index->quantumMillis;
+    index->capacity = (int)(durationMillis / index->intervalMillis) + 1;
+    index->checkpoints = calloc(index->capacity, sizeof(checkpoint_t));
+    if (index->checkpoints == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+    atomic_init(&index->count, 0);
+    atomic_init(&index->memoryUsage, sizeof(seekindex_t) + index->capacity * sizeof(checkpoint_t));
+    return index;
+}
+
+void seekindex_destroy(seekindex_t *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    int count = atomic_load(&index->count);
+    for (int n = 0; n < count; n++)
+    {
+        free(index->checkpoints[n].blockIndexes);
+        free(index->checkpoints[n].blocks);
+    }
+    free(index->checkpoints);
+    free(index->shadow);
+    free(index);
+}
+
+static bool block_changed(const seekindex_t *index, const unsigned char *block, uint32_t blockIndex, bool keyframe)
+{
+    // keyframes are stored against zeroed memory so they can be restored without their predecessors
+    const unsigned char *reference = keyframe ? zeroblock : index->shadow + (size_t)blockIndex * BLOCK_SIZE;
+    return memcmp(block, reference, BLOCK_SIZE) != 0;
+}
+
+void seekindex_record(seekindex_t *index, instrlib_t *instrlib)
+{
+    int count = atomic_load_explicit(&index->count, memory_order_relaxed);
+    if (count == index->capacity)
+    {
+        return;
+    }
+    double millis = instrlib_getCurrentTimeMillis(instrlib);
+    double checkpointMillis = count * index->intervalMillis;
+    // only the quantum that reaches the interval records, after jumping ahead the index waits for playback to come back
+    if (millis < checkpointMillis || millis >= checkpointMillis + index->quantumMillis)
+    {
+        return;
+    }
+
+    const w2c_instruments *instance = &instrlib->instance;
+    const wasm_rt_memory_t *memory = &instance->w2c_memory;
+    if (memory->size > index->shadowSize)
+    {
+        // without memory for the shadow the index stops here, seeks use the checkpoints it has
+        unsigned char *shadow = realloc(index->shadow, memory->size);
+        if (shadow == NULL)
+        {
+            return;
+        }
+        index->shadow = shadow;
+        memset(index->shadow + index->shadowSize, 0, memory->size - index->shadowSize);
+        index->shadowSize = memory->size;
+    }
+
+    checkpoint_t *checkpoint = &index->checkpoints[count];
+    checkpoint->millis = millis;
+    checkpoint->pages = memory->pages;
+    memcpy(checkpoint->globals, (const unsigned char *)instance + INSTRLIB_GLOBALS_OFFSET, INSTRLIB_GLOBALS_SIZE);
+
+    const bool keyframe = count % KEYFRAME_INTERVAL == 0;
+    const uint32_t totalBlocks = (uint32_t)(memory->size / BLOCK_SIZE);
+    uint32_t numBlocks = 0;
+    for (uint32_t block = 0; block < totalBlocks; block++)
+    {
+        numBlocks += block_changed(index, memory->data + (size_t)block * BLOCK_SIZE, block, keyframe);
+    }
+
+    checkpoint->numBlocks = numBlocks;
+    checkpoint->blockIndexes = malloc((numBlocks + 1) * sizeof(uint32_t));
+    checkpoint->blocks = malloc((size_t)(numBlocks + 1) * BLOCK_SIZE);
+    if (checkpoint->blockIndexes == NULL || checkpoint->blocks == NULL)
+    {
+        free(checkpoint->blockIndexes);
+        free(checkpoint->blocks);
+        checkpoint->blockIndexes = NULL;
+        checkpoint->blocks = NULL;
+        return;
+    }
+    uint32_t stored = 0;
+    for (uint32_t block = 0; block < totalBlocks && stored < numBlocks; block++)
+    {
+        const unsigned char *data = memory->data + (size_t)block * BLOCK_SIZE;
+        if (block_changed(index, data, block, keyframe))
+        {
+            checkpoint->blockIndexes[stored] = block;
+            memcpy(checkpoint->blocks + (size_t)stored * BLOCK_SIZE, data, BLOCK_SIZE);
+            stored++;
+        }
+    }
+    memcpy(index->shadow, memory->data, memory->size);
+
+    atomic_fetch_add_explicit(&index->memoryUsage, (size_t)numBlocks * (BLOCK_SIZE + sizeof(uint32_t)),
+                              memory_order_relaxed);
+    atomic_store_explicit(&index->count, count + 1, memory_order_release);
+}
+
+void seekindex_prepass(seekindex_t *index)
+{
+    instrlib_t *instrlib = instrlib_create(index->samplerate);
+    if (instrlib == NULL)
+    {
+        return;
+    }
+    // the last checkpoint is at most one interval before the end, a checkpoint that was missed does not keep it going
+    const int numQuanta = (int)(instrlib_getDuration(instrlib) / index->quantumMillis) + 2;
+    for (int quantum = 0; quantum < numQuanta; quantum++)
+    {
+        seekindex_record(index, instrlib);
+        if (atomic_load_explicit(&index->count, memory_order_relaxed) == index->capacity)
+        {
+            break;
+        }
+        instrlib_playEventsAndFillSampleBuffer(instrlib);
+    }
+    instrlib_destroy(instrlib);
+}
+
+static bool restore_checkpoint(const seekindex_t *index, int target, w2c_instruments *instance)
+{
+    const checkpoint_t *checkpoint = &index->checkpoints[target];
+    wasm_rt_memory_t *memory = &instance->w2c_memory;
+    // the blocks of the checkpoint and its predecessors reach up to the pages it had
+    if (memory->pages < checkpoint->pages &&
+        wasm_rt_grow_memory(memory, checkpoint->pages - memory->pages) == (uint64_t)-1)
+    {
+        return false;
+    }
+    // wasm memory cannot shrink, pages the checkpoint did not have yet are left zeroed
+    memset(memory->data, 0, memory->size);
+
+    for (int n = target - target % KEYFRAME_INTERVAL; n <= target; n++)
+    {
+        const checkpoint_t *delta = &index->checkpoints[n];
+        for (uint32_t block = 0; block < delta->numBlocks; block++)
+        {
+            memcpy(memory->data + (size_t)delta->blockIndexes[block] * BLOCK_SIZE,
+                   delta->blocks + (size_t)block * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    memcpy((unsigned char *)instance + INSTRLIB_GLOBALS_OFFSET, checkpoint->globals, INSTRLIB_GLOBALS_SIZE);
+    return true;
+}
+
+int seekindex_seek(seekindex_t *index, instrlib_t *instrlib, double millis)
+{
+    int count = atomic_load_explicit(&index->count, memory_order_acquire);
+    if (count == 0 || instrlib_getSampleRate(instrlib) != index->samplerate)
+    {
+        return -1;
+    }
+    int target = millis > 0 ? (int)(millis / index->intervalMillis) : 0;
+    if (target >= count)
+    {
+        target = count - 1;
+    }
+    while (target > 0 && index->checkpoints[target].millis > millis)
+    {
+        target--;
+    }
+
+    instrlib_thread_enter();
+    if (!restore_checkpoint(index, target, &instrlib->instance))
+    {
+        return -1;
+    }
+
+    int rendered = 0;
+    while (instrlib_getCurrentTimeMillis(instrlib) + index->quantumMillis <= millis)
+    {
+        instrlib_playEventsAndFillSampleBuffer(instrlib);
+        rendered++;
+    }
+    return rendered;
+}
+
+int seekindex_getNumCheckpoints(const seekindex_t *index)
+{
+    return atomic_load_explicit(&((seekindex_t *)index)->count, memory_order_acquire);
+}
+
+size_t seekindex_getMemoryUsage(const seekindex_t *index)
+{
+    return atomic_load_explicit(&((seekindex_t *)index)->memoryUsage, memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include "instrlib.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A seek index holds checkpoints of the complete synth state (linear memory
+ * and all module globals) taken every intervalMillis of song time. Seeking
+ * restores the nearest checkpoint before the target and renders forward only
+ * the remainder, so the cost no longer grows with the target position, and the
+ * result is exactly the state that playing from the start would have reached.
+ *
+ * Memory is stored in 4 KiB blocks, and each checkpoint only keeps the blocks
+ * that changed since the previous one. Every 16th checkpoint is a keyframe
+ * that keeps all non-zero blocks, which bounds the work of a restore.
+ *
+ * One thread may record (seekindex_record or seekindex_prepass) while other
+ * threads seek with the checkpoints recorded so far.
+ */
+typedef struct seekindex seekindex_t;
+
+/* The index is sized for the song in the module, at the given samplerate. NULL when out of memory. */
+seekindex_t *seekindex_create(float samplerate, double intervalMillis);
+void seekindex_destroy(seekindex_t *index);
+
+/*
+ * Call between quanta during uninterrupted song playback. Stores a checkpoint
+ * whenever the song clock reaches the next interval. This copies memory, so do
+ * not call it from a realtime thread.
+ */
+void seekindex_record(seekindex_t *index, instrlib_t *instrlib);
+
+/* Plays the whole song on a private instance and records every checkpoint. */
+void seekindex_prepass(seekindex_t *index);
+
+/*
+ * Moves instrlib to millis. Returns the number of quanta rendered after the
+ * restored checkpoint, or -1 if no usable checkpoint exists yet (or the
+ * samplerate differs, or memory can not grow to the size the checkpoint had),
+ * in which case instrlib is unchanged and the caller should use instrlib_seek.
+ */
+int seekindex_seek(seekindex_t *index, instrlib_t *instrlib, double millis);
+
+int seekindex_getNumCheckpoints(const seekindex_t *index);
+size_t seekindex_getMemoryUsage(const seekindex_t *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,195 @@
+#include "./instrlib.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Renders the song with a scalar and a SIMD128 build of the same synth and
+ * compares speed and output. Both builds define the same symbols, so each is a
+ * shared library (build.sh) loaded with RTLD_LOCAL, and the instrlib functions
+ * are looked up per library. The runs alternate between the builds so that
+ * frequency scaling affects both alike.
+ *
+ * Both builds are bounds checked rather than guard paged: two runtimes in one
+ * process would each install the SIGSEGV handler, and a trap in one build
+ * would be handled by the other. The numbers are therefore comparable with
+ * each other and with membench_boundscheck, not with the guard page build.
+ */
+
+#define QUANTUM_FRAMES 128
+
+typedef struct
+{
+    const char *path;
+    void *handle;
+    instrlib_t *(*create)(float samplerate);
+    void (*destroy)(instrlib_t *instrlib);
+    uint32_t (*getDuration)(instrlib_t *instrlib);
+    void (*playEventsAndFillSampleBuffer)(instrlib_t *instrlib);
+    float *(*getSampleBuffer)(instrlib_t *instrlib);
+    float *output;    // left and right quantum after quantum, as in the sample buffer
+    double bestNs;
+} build_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-d seconds] [-n runs] [scalar.so simd.so]\n"
+            "  renders the song with the scalar and the SIMD128 build of the synth and\n"
+            "  reports ns per sample and whether the output is bit-exact\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -d  seconds of song to render (default: the whole song)\n"
+            "  -n  runs per build, the fastest is reported (default 3)\n"
+            "  the builds default to ./libinstrlib_scalar.so and simd/libinstrlib_simd.so\n",
+            name);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *lookup(build_t *build, const char *symbol)
+{
+    void *address = dlsym(build->handle, symbol);
+    if (!address)
+    {
+        fprintf(stderr, "%s: no %s\n", build->path, symbol);
+        exit(1);
+    }
+    return address;
+}
+
+static void load(build_t *build)
+{
+    build->handle = dlopen(build->path, RTLD_NOW | RTLD_LOCAL);
+    if (!build->handle)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+    build->create = lookup(build, "instrlib_create");
+    build->destroy = lookup(build, "instrlib_destroy");
+    build->getDuration = lookup(build, "instrlib_getDuration");
+    build->playEventsAndFillSampleBuffer = lookup(build, "instrlib_playEventsAndFillSampleBuffer");
+    build->getSampleBuffer = lookup(build, "instrlib_getSampleBuffer");
+}
+
+static void render(build_t *build, float samplerate, int numQuanta)
+{
+    instrlib_t *instrlib = build->create(samplerate);
+    double start = now_seconds();
+    for (int quantum = 0; quantum < numQuanta; quantum++)
+    {
+        build->playEventsAndFillSampleBuffer(instrlib);
+        const float *renderbuf = build->getSampleBuffer(instrlib);
+        for (int n = 0; n < 2 * QUANTUM_FRAMES; n++)
+        {
+            build->output[quantum * 2 * QUANTUM_FRAMES + n] = renderbuf[n];
+        }
+    }
+    double ns = (now_seconds() - start) * 1e9 / ((double)numQuanta * QUANTUM_FRAMES);
+    build->destroy(instrlib);
+    if (build->bestNs == 0 || ns < build->bestNs)
+    {
+        build->bestNs = ns;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    double seconds = 0;
+    int runs = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:n:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((argc - optind != 0 && argc - optind != 2) || samplerate <= 0 || seconds < 0 || runs < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    build_t scalar = {.path = argc - optind == 2 ? argv[optind] : "./libinstrlib_scalar.so"};
+    build_t simd = {.path = argc - optind == 2 ? argv[optind + 1] : "simd/libinstrlib_simd.so"};
+    load(&scalar);
+    load(&simd);
+
+    if (seconds == 0)
+    {
+        instrlib_t *instrlib = scalar.create(samplerate);
+        seconds = scalar.getDuration(instrlib) / 1000.0;
+        scalar.destroy(instrlib);
+    }
+    int numQuanta = (int)(seconds * samplerate / QUANTUM_FRAMES) + 1;
+    scalar.output = malloc((size_t)numQuanta * 2 * QUANTUM_FRAMES * sizeof(float));
+    simd.output = malloc((size_t)numQuanta * 2 * QUANTUM_FRAMES * sizeof(float));
+
+    for (int run = 0; run < runs; run++)
+    {
+        render(&scalar, samplerate, numQuanta);
+        render(&simd, samplerate, numQuanta);
+    }
+
+    long numSamples = (long)numQuanta * 2 * QUANTUM_FRAMES;
+    long numDifferent = 0, firstDifferent = -1;
+    double maxError = 0;
+    for (long n = 0; n < numSamples; n++)
+    {
+        // bitwise, so that NaNs and signed zeros count too
+        if (memcmp(&scalar.output[n], &simd.output[n], sizeof(float)) != 0)
+        {
+            if (firstDifferent < 0)
+            {
+                firstDifferent = n;
+            }
+            numDifferent++;
+            double error = fabs((double)scalar.output[n] - simd.output[n]);
+            maxError = error > maxError ? error : maxError;
+        }
+    }
+
+    printf("%d quanta (%.1f s) at %.0f Hz, best of %d runs\n", numQuanta, numQuanta * QUANTUM_FRAMES / samplerate,
+           samplerate, runs);
+    printf("%-8s %14s %10s\n", "build", "ns/sample", "speedup");
+    printf("%-8s %14.2f %10.2f\n", "scalar", scalar.bestNs, 1.0);
+    printf("%-8s %14.2f %10.2f\n", "simd128", simd.bestNs, scalar.bestNs / simd.bestNs);
+    if (numDifferent == 0)
+    {
+        printf("output is bit-exact\n");
+    }
+    else
+    {
+        long frame = firstDifferent / (2 * QUANTUM_FRAMES) * QUANTUM_FRAMES + firstDifferent % QUANTUM_FRAMES;
+        printf("%ld of %ld samples differ, first at %.3f s, largest error %g (%.1f dBFS)\n", numDifferent, numSamples,
+               frame / samplerate, maxError, 20 * log10(maxError));
+    }
+
+    free(scalar.output);
+    free(simd.output);
+    return numDifferent != 0;
+}
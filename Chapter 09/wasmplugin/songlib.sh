@@ -0,0 +1,19 @@
+#!/bin/bash
+# Builds instrlib with another song as a shared library: songlib.sh song.wasm libsong.so
+# WasmSynth runs it to hot reload ~/song.wasm when WASMSYNTH_SONGLIB points to this script
+WASM2C=/opt/homebrew/Cellar/wabt/1.0.34/share/wabt/wasm2c
+# the plugin's own runtime has installed the SIGSEGV handler for guard pages, and a second runtime would replace it
+# with one that longjmps through the wrong jump buffer. The library is bounds checked and installs no handler
+MEMCHECK=-DWASM_RT_MEMCHECK_BOUNDS_CHECK=1
+RTRENAME="-Dwasm_rt_allocate_memory=wasm_rt_impl_allocate_memory -Dwasm_rt_grow_memory=wasm_rt_impl_grow_memory -Dwasm_rt_free_memory=wasm_rt_impl_free_memory"
+# the library's own instrlib functions, not the ones linked into the plugin
+SYMBOLIC=$([ "$(uname)" = Linux ] && echo -Wl,-Bsymbolic)
+set -e
+SRC=$(cd "$(dirname "$0")" && pwd)
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+wasm2c "$1" -n instruments -o $OUT/instruments.c
+# copied so that instrlib.c includes the new instruments.h
+cp $SRC/instrlib.c $SRC/instrlib.h $SRC/instrlib_internal.h $SRC/instrlib_memory.c $SRC/instrlib_template.c $SRC/mixkernels.h $SRC/renderengine.c $SRC/renderengine.h $OUT/
+(cd $OUT && clang -O3 -fPIC -I$WASM2C $MEMCHECK $RTRENAME $WASM2C/wasm-rt-impl.c -c && clang -O3 -fPIC -shared $SYMBOLIC -I$WASM2C -I/opt/homebrew/include $MEMCHECK instruments.c instrlib.c instrlib_memory.c instrlib_template.c renderengine.c wasm-rt-impl.o -lm -lpthread -o libsong.so)
+mv $OUT/libsong.so "$2"
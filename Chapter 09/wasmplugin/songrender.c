@@ -0,0 +1,411 @@
+#include "./instrlib.h"
+#include "./wavheader.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUANTUM_FRAMES 128
+#define WRITE_FRAMES 4096
+
+typedef struct
+{
+    FILE *fp;
+    int bitsPerSample;
+    float gain;
+    unsigned char *buffer;
+    int bufferedFrames;
+} wavwriter_t;
+
+typedef struct
+{
+    float samplerate;
+    int firstQuantum;  // where rendering starts, pre-roll and crossfade included
+    int fadeQuantum;   // where the crossfade with the previous segment starts
+    int startQuantum;
+    int endQuantum;
+    float *left;
+    float *right;
+    float *fadeLeft;
+    float *fadeRight;
+    pthread_t thread;
+} segment_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-b 16|24|32] [-g gain] [-t tailmillis]\n"
+            "       [-s segments] [-p prerollmillis] [-x crossfademillis] [-v] output.wav\n"
+            "  renders the song compiled into the synth as fast as possible\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -b  bits per sample, 32 is float (default 32)\n"
+            "  -g  output gain (default 0.3)\n"
+            "  -t  milliseconds to keep rendering after the song ends (default 0)\n"
+            "  -s  split the song into this many segments rendered in parallel (default 1)\n"
+            "  -p  pre-roll before each segment so envelopes and reverbs settle (default 2000)\n"
+            "  -x  crossfade between segments (default 10)\n"
+            "  -v  also render serially and report the largest sample error\n"
+            "  use - as output to stream the wav to stdout\n",
+            name);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int to_pcm(float sample, float scale)
+{
+    if (sample > 1.0f)
+    {
+        sample = 1.0f;
+    }
+    else if (sample < -1.0f)
+    {
+        sample = -1.0f;
+    }
+    return (int)lrintf(sample * scale);
+}
+
+static void wavwriter_flush(wavwriter_t *writer)
+{
+    fwrite(writer->buffer, writer->bitsPerSample / 8 * 2, writer->bufferedFrames, writer->fp);
+    writer->bufferedFrames = 0;
+}
+
+static void wavwriter_write(wavwriter_t *writer, const float *left, const float *right, int numFrames)
+{
+    const int bytesPerSample = writer->bitsPerSample / 8;
+    for (int ndx = 0; ndx < numFrames; ndx++)
+    {
+        if (writer->bufferedFrames == WRITE_FRAMES)
+        {
+            wavwriter_flush(writer);
+        }
+        unsigned char *out = writer->buffer + writer->bufferedFrames * bytesPerSample * 2;
+        const float frame[2] = {left[ndx] * writer->gain, right[ndx] * writer->gain};
+        for (int channel = 0; channel < 2; channel++, out += bytesPerSample)
+        {
+            if (writer->bitsPerSample == 32)
+            {
+                memcpy(out, &frame[channel], 4);
+            }
+            else if (writer->bitsPerSample == 24)
+            {
+                int value = to_pcm(frame[channel], 8388607.0f);
+                out[0] = value & 0xff;
+                out[1] = (value >> 8) & 0xff;
+                out[2] = (value >> 16) & 0xff;
+            }
+            else
+            {
+                short value = (short)to_pcm(frame[channel], 32767.0f);
+                memcpy(out, &value, 2);
+            }
+        }
+        writer->bufferedFrames++;
+    }
+}
+
+static void wavwriter_writeAll(wavwriter_t *writer, const float *left, const float *right, int numFrames)
+{
+    wavwriter_write(writer, left, right, numFrames);
+    wavwriter_flush(writer);
+}
+
+// Song position of a quantum, accumulated the same way as the module advances its clock
+static double quantum_to_millis(float samplerate, int quantum)
+{
+    const double quantumMillis = 128000.0 / (double)samplerate;
+    double millis = 0;
+    for (int n = 0; n < quantum; n++)
+    {
+        millis += quantumMillis;
+    }
+    return millis;
+}
+
+static void *render_segment(void *arg)
+{
+    segment_t *segment = arg;
+    instrlib_t *instrlib = instrlib_create(segment->samplerate);
+    if (segment->firstQuantum > 0)
+    {
+        instrlib_seek(instrlib, quantum_to_millis(segment->samplerate, segment->firstQuantum));
+    }
+
+    for (int quantum = segment->firstQuantum; quantum < segment->endQuantum; quantum++)
+    {
+        instrlib_playEventsAndFillSampleBuffer(instrlib);
+        if (quantum < segment->fadeQuantum)
+        {
+            continue;
+        }
+        const float *renderbuf = instrlib_getSampleBuffer(instrlib);
+        float *left = segment->left;
+        float *right = segment->right;
+        int offset = quantum * QUANTUM_FRAMES;
+        if (quantum < segment->startQuantum)
+        {
+            left = segment->fadeLeft;
+            right = segment->fadeRight;
+            offset = (quantum - segment->fadeQuantum) * QUANTUM_FRAMES;
+        }
+        memcpy(left + offset, renderbuf, QUANTUM_FRAMES * sizeof(float));
+        memcpy(right + offset, renderbuf + QUANTUM_FRAMES, QUANTUM_FRAMES * sizeof(float));
+    }
+
+    instrlib_destroy(instrlib);
+    instrlib_thread_free();
+    return NULL;
+}
+
+static void render_serial(float samplerate, int numQuanta, float *left, float *right)
+{
+    segment_t segment = {.samplerate = samplerate, .endQuantum = numQuanta, .left = left, .right = right};
+    render_segment(&segment);
+}
+
+static void free_segments(segment_t *segments, int numSegments)
+{
+    for (int n = 0; n < numSegments; n++)
+    {
+        free(segments[n].fadeLeft);
+        free(segments[n].fadeRight);
+    }
+    free(segments);
+}
+
+/* false when a buffer or a thread could not be created, after the threads that did start have finished */
+static bool render_segments(float samplerate, int numQuanta, int numSegments,
+                            int prerollQuanta, int fadeQuanta, float *left, float *right)
+{
+    segment_t *segments = calloc(numSegments, sizeof(segment_t));
+    if (segments == NULL)
+    {
+        return false;
+    }
+    int numStarted = 0;
+    for (int n = 0; n < numSegments; n++)
+    {
+        segment_t *segment = &segments[n];
+        segment->samplerate = samplerate;
+        segment->startQuantum = (int)((long)numQuanta * n / numSegments);
+        segment->endQuantum = (int)((long)numQuanta * (n + 1) / numSegments);
+        segment->fadeQuantum = segment->startQuantum - fadeQuanta;
+        if (segment->fadeQuantum < 0)
+        {
+            segment->fadeQuantum = 0;
+        }
+        segment->firstQuantum = segment->fadeQuantum - prerollQuanta;
+        if (segment->firstQuantum < 0)
+        {
+            segment->firstQuantum = 0;
+        }
+        segment->left = left;
+        segment->right = right;
+        int fadeFrames = (segment->startQuantum - segment->fadeQuantum) * QUANTUM_FRAMES;
+        segment->fadeLeft = malloc((fadeFrames + 1) * sizeof(float));
+        segment->fadeRight = malloc((fadeFrames + 1) * sizeof(float));
+        if (segment->fadeLeft == NULL || segment->fadeRight == NULL
+            || pthread_create(&segment->thread, NULL, render_segment, segment) != 0)
+        {
+            break;
+        }
+        numStarted++;
+    }
+
+    for (int n = 0; n < numStarted; n++)
+    {
+        pthread_join(segments[n].thread, NULL);
+    }
+    if (numStarted < numSegments)
+    {
+        free_segments(segments, numSegments);
+        return false;
+    }
+
+    // the previous segment has rendered through the crossfade region, blend the new one in linearly
+    for (int n = 1; n < numSegments; n++)
+    {
+        segment_t *segment = &segments[n];
+        int fadeStart = segment->fadeQuantum * QUANTUM_FRAMES;
+        int fadeFrames = (segment->startQuantum - segment->fadeQuantum) * QUANTUM_FRAMES;
+        for (int ndx = 0; ndx < fadeFrames; ndx++)
+        {
+            float weight = (ndx + 0.5f) / fadeFrames;
+            left[fadeStart + ndx] += (segment->fadeLeft[ndx] - left[fadeStart + ndx]) * weight;
+            right[fadeStart + ndx] += (segment->fadeRight[ndx] - right[fadeStart + ndx]) * weight;
+        }
+    }
+
+    free_segments(segments, numSegments);
+    return true;
+}
+
+static void report_error(const float *left, const float *right, const float *refLeft, const float *refRight,
+                         int numFrames, float samplerate, float gain)
+{
+    float maxError = 0;
+    int maxErrorFrame = 0;
+    for (int ndx = 0; ndx < numFrames; ndx++)
+    {
+        float error = fmaxf(fabsf(left[ndx] - refLeft[ndx]), fabsf(right[ndx] - refRight[ndx]));
+        if (error > maxError)
+        {
+            maxError = error;
+            maxErrorFrame = ndx;
+        }
+    }
+    // the error is reported as it ends up in the output file, after the gain
+    maxError *= gain;
+    if (maxError == 0)
+    {
+        fprintf(stderr, "verify: bit exact against serial render\n");
+    }
+    else
+    {
+        fprintf(stderr, "verify: max sample error %g (%.1f dBFS) at %.3f s\n",
+                maxError, 20 * log10f(maxError), maxErrorFrame / samplerate);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    int bitsPerSample = 32;
+    float gain = 0.3;
+    double tailMillis = 0;
+    int numSegments = 1;
+    double prerollMillis = 2000;
+    double fadeMillis = 10;
+    bool verify = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:g:t:s:p:x:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'b':
+            bitsPerSample = atoi(optarg);
+            break;
+        case 'g':
+            gain = atof(optarg);
+            break;
+        case 't':
+            tailMillis = atof(optarg);
+            break;
+        case 's':
+            numSegments = atoi(optarg);
+            break;
+        case 'p':
+            prerollMillis = atof(optarg);
+            break;
+        case 'x':
+            fadeMillis = atof(optarg);
+            break;
+        case 'v':
+            verify = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || samplerate <= 0 || numSegments < 1 || prerollMillis < 0 || fadeMillis < 0 ||
+        (bitsPerSample != 16 && bitsPerSample != 24 && bitsPerSample != 32))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *outputPath = argv[optind];
+    FILE *fp = strcmp(outputPath, "-") == 0 ? stdout : fopen(outputPath, "wb");
+    if (fp == NULL)
+    {
+        perror(outputPath);
+        return 1;
+    }
+
+    double startTime = now_seconds();
+    instrlib_t *instrlib = instrlib_create(samplerate);
+    double durationMillis = instrlib_getDuration(instrlib) + tailMillis;
+
+    // the song advances by exactly one quantum per call, so the length is known before rendering
+    int numQuanta = (int)ceil(durationMillis * samplerate / 1000.0 / QUANTUM_FRAMES);
+    int numFrames = numQuanta * QUANTUM_FRAMES;
+
+    wavwriter_t writer = {fp, bitsPerSample, gain, malloc(WRITE_FRAMES * 2 * bitsPerSample / 8), 0};
+    writeWavHeader(fp, (int)samplerate, 2, bitsPerSample, numFrames);
+
+    if (numSegments == 1 && !verify)
+    {
+        for (int quantum = 0; quantum < numQuanta; quantum++)
+        {
+            instrlib_playEventsAndFillSampleBuffer(instrlib);
+            const float *renderbuf = instrlib_getSampleBuffer(instrlib);
+            wavwriter_write(&writer, renderbuf, renderbuf + QUANTUM_FRAMES, QUANTUM_FRAMES);
+        }
+        wavwriter_flush(&writer);
+    }
+    else
+    {
+        float *left = malloc(numFrames * sizeof(float));
+        float *right = malloc(numFrames * sizeof(float));
+        int prerollQuanta = (int)ceil(prerollMillis * samplerate / 1000.0 / QUANTUM_FRAMES);
+        int fadeQuanta = (int)ceil(fadeMillis * samplerate / 1000.0 / QUANTUM_FRAMES);
+        if (left == NULL || right == NULL
+            || !render_segments(samplerate, numQuanta, numSegments, prerollQuanta, fadeQuanta, left, right))
+        {
+            fprintf(stderr, "could not start %d segment renders\n", numSegments);
+            return 1;
+        }
+        wavwriter_writeAll(&writer, left, right, numFrames);
+
+        if (verify)
+        {
+            double segmentedElapsed = now_seconds() - startTime;
+            double serialStartTime = now_seconds();
+            float *refLeft = malloc(numFrames * sizeof(float));
+            float *refRight = malloc(numFrames * sizeof(float));
+            render_serial(samplerate, numQuanta, refLeft, refRight);
+            double serialElapsed = now_seconds() - serialStartTime;
+            fprintf(stderr, "verify: serial render took %.2f s, %d segments took %.2f s, %.1fx speedup\n",
+                    serialElapsed, numSegments, segmentedElapsed, serialElapsed / segmentedElapsed);
+            report_error(left, right, refLeft, refRight, numFrames, samplerate, gain);
+            free(refLeft);
+            free(refRight);
+            // the verification render is not part of the realtime factor
+            startTime += serialElapsed;
+        }
+        free(left);
+        free(right);
+    }
+
+    double elapsed = now_seconds() - startTime;
+    double audioSeconds = numFrames / samplerate;
+    fprintf(stderr, "rendered %.2f s of audio in %.2f s, %.1fx realtime\n",
+            audioSeconds, elapsed, audioSeconds / elapsed);
+
+    free(writer.buffer);
+    instrlib_destroy(instrlib);
+    if (fp != stdout)
+    {
+        fclose(fp);
+    }
+    else
+    {
+        fflush(fp);
+    }
+    return 0;
+}
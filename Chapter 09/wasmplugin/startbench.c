@@ -0,0 +1,86 @@
+#include "./instrlib_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate]\n"
+            "  creates 1, 16 and 256 instances by full instantiation and by cloning the\n"
+            "  samplerate's template, and reports the time per batch and per instance\n"
+            "  -r  samplerate (default 44100)\n",
+            name);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double create_batch(instrlib_t **instances, int count, float samplerate, bool cold,
+                           const instrlib_memory_options_t *options)
+{
+    double start = now_seconds();
+    for (int n = 0; n < count; n++)
+    {
+        instances[n] = cold ? instrlib_create_instantiated(samplerate, options)
+                            : instrlib_create_with_memory(samplerate, options);
+    }
+    double elapsed = now_seconds() - start;
+    for (int n = 0; n < count; n++)
+    {
+        instrlib_destroy(instances[n]);
+    }
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || samplerate <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // the first create at a samplerate pays for the template
+    double templateStart = now_seconds();
+    instrlib_destroy(instrlib_create(samplerate));
+    printf("template for %.0f Hz created in %.0f us\n", samplerate, (now_seconds() - templateStart) * 1e6);
+
+    const instrlib_memory_options_t shared = {INSTRLIB_MEMORY_SHARED, 0, 0};
+    const int counts[] = {1, 16, 256};
+    instrlib_t **instances = malloc(256 * sizeof(instrlib_t *));
+    printf("%10s %16s %16s %16s %16s %16s\n", "instances", "cold ms", "clone ms", "shared ms", "cold us/inst",
+           "clone us/inst");
+    for (int c = 0; c < 3; c++)
+    {
+        int count = counts[c];
+        double cold = create_batch(instances, count, samplerate, true, NULL);
+        double clone = create_batch(instances, count, samplerate, false, NULL);
+        double cloneShared = create_batch(instances, count, samplerate, false, &shared);
+        printf("%10d %16.3f %16.3f %16.3f %16.1f %16.1f\n", count, cold * 1e3, clone * 1e3, cloneShared * 1e3,
+               cold * 1e6 / count, clone * 1e6 / count);
+    }
+    free(instances);
+    return 0;
+}
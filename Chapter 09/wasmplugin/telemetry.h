@@ -0,0 +1,355 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * How close the audio callback runs to its deadline. The audio thread reports
+ * every callback with the number of samples it had to produce, which at the
+ * prepared samplerate is its deadline, and every render call with the number
+ * of frames it rendered. Callbacks that took longer than their deadline count
+ * as xruns: the host may still have had slack, but the plugin used more than
+ * the whole period by itself. Voices that PolyphonyGovernor stole are counted
+ * too, to tune its budget against the load they were stolen at.
+ *
+ * Load (callback time / deadline) and time per quantum go into histograms with
+ * logarithmic buckets, at most 12.5% wide, that only the audio thread writes to.
+ * Recording is a few relaxed atomic stores, it never locks, allocates or makes
+ * a system call. Any other thread can poll getSummary, and with a dump path the
+ * summary is appended to that file as a line of JSON every dump interval by a
+ * background thread shared by all RenderTelemetry instances.
+ *
+ * One RenderTelemetry belongs to one audio callback. Create and destroy it
+ * outside the audio thread.
+ */
+class RenderTelemetry
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /* The frames instrlib and the song render per call into the module */
+    static constexpr int quantumFrames = 128;
+
+    struct Percentiles
+    {
+        double p50;
+        double p99;
+        double max;
+    };
+
+    struct Summary
+    {
+        double sampleRate;
+        uint64_t numCallbacks;
+        uint64_t numXruns;
+        uint64_t numVoicesStolen;
+        // callback time / (numSamples / sampleRate)
+        Percentiles load;
+        Percentiles quantumMicros;
+    };
+
+    explicit RenderTelemetry(const char *name, std::string dumpPath = {}, double dumpIntervalSeconds = 10)
+        : name(name), dumpPath(std::move(dumpPath)),
+          dumpInterval(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(dumpIntervalSeconds)))
+    {
+        if (!this->dumpPath.empty())
+        {
+            Dumper::get().add(this);
+        }
+    }
+
+    ~RenderTelemetry()
+    {
+        if (!dumpPath.empty())
+        {
+            Dumper::get().remove(this);
+        }
+    }
+
+    /* From prepareToPlay */
+    void prepare(double newSampleRate) noexcept
+    {
+        sampleRate.store(newSampleRate, std::memory_order_relaxed);
+    }
+
+    static Clock::time_point now() noexcept
+    {
+        return Clock::now();
+    }
+
+    /* Audio thread: at the end of the callback that started at start, returns its load */
+    double callbackFinished(Clock::time_point start, int numSamples) noexcept
+    {
+        const double rate = sampleRate.load(std::memory_order_relaxed);
+        if (numSamples <= 0 || rate <= 0)
+        {
+            return 0;
+        }
+        const double elapsedNanos = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(now() - start).count();
+        const double deadlineNanos = numSamples * 1e9 / rate;
+        // in units of 1/10000 of the deadline
+        load.record((uint64_t)(elapsedNanos * 1e4 / deadlineNanos));
+        increment(numCallbacks);
+        if (elapsedNanos > deadlineNanos)
+        {
+            increment(numXruns);
+        }
+        return elapsedNanos / deadlineNanos;
+    }
+
+    /* Audio thread: after rendering numFrames in quanta of at most quantumFrames, starting at start */
+    void renderFinished(Clock::time_point start, int numFrames) noexcept
+    {
+        if (numFrames <= 0)
+        {
+            return;
+        }
+        const uint64_t elapsedNanos = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now() - start).count();
+        quantumNanos.record(elapsedNanos / (uint64_t)((numFrames + quantumFrames - 1) / quantumFrames));
+    }
+
+    /* Audio thread */
+    void voicesStolen(int numVoices) noexcept
+    {
+        if (numVoices > 0)
+        {
+            numVoicesStolen.store(numVoicesStolen.load(std::memory_order_relaxed) + (uint64_t)numVoices, std::memory_order_relaxed);
+        }
+    }
+
+    /* Any thread. Taken while the audio thread keeps recording, so the numbers may be a callback apart. */
+    Summary getSummary() const
+    {
+        Summary summary;
+        summary.sampleRate = sampleRate.load(std::memory_order_relaxed);
+        summary.numCallbacks = numCallbacks.load(std::memory_order_relaxed);
+        summary.numXruns = numXruns.load(std::memory_order_relaxed);
+        summary.numVoicesStolen = numVoicesStolen.load(std::memory_order_relaxed);
+        summary.load = load.getPercentiles(1e-4);
+        summary.quantumMicros = quantumNanos.getPercentiles(1e-3);
+        return summary;
+    }
+
+    /* The summary as one line of JSON */
+    std::string toJson() const
+    {
+        const Summary summary = getSummary();
+        const long long millis =
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "{\"name\": \"%s\", \"instance\": \"%p\", \"time_ms\": %lld, \"samplerate\": %.0f, \"callbacks\": %llu, "
+                      "\"xruns\": %llu, \"voices_stolen\": %llu, \"load\": {\"p50\": %.4f, \"p99\": %.4f, \"max\": %.4f}, "
+                      "\"quantum_us\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}}",
+                      name, (const void *)this, millis, summary.sampleRate, (unsigned long long)summary.numCallbacks,
+                      (unsigned long long)summary.numXruns, (unsigned long long)summary.numVoicesStolen, summary.load.p50, summary.load.p99, summary.load.max,
+                      summary.quantumMicros.p50, summary.quantumMicros.p99, summary.quantumMicros.max);
+        return line;
+    }
+
+private:
+    /* Only the audio thread writes, so a load and a store do instead of a locked read-modify-write */
+    static void increment(std::atomic<uint64_t> &counter) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /*
+     * Values below 16 have a bucket each, above that every power of two is
+     * split into 8 buckets, up to 2^40.
+     */
+    class Histogram
+    {
+    public:
+        void record(uint64_t value) noexcept
+        {
+            std::atomic<uint32_t> &count = counts[bucketOf(value)];
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (value > max.load(std::memory_order_relaxed))
+            {
+                max.store(value, std::memory_order_relaxed);
+            }
+        }
+
+        Percentiles getPercentiles(double scale) const
+        {
+            uint32_t snapshot[numBuckets];
+            uint64_t total = 0;
+            for (int bucket = 0; bucket < numBuckets; bucket++)
+            {
+                snapshot[bucket] = counts[bucket].load(std::memory_order_relaxed);
+                total += snapshot[bucket];
+            }
+            const double maxValue = (double)max.load(std::memory_order_relaxed);
+            return {percentile(snapshot, total, 0.5, maxValue) * scale, percentile(snapshot, total, 0.99, maxValue) * scale,
+                    maxValue * scale};
+        }
+
+    private:
+        static constexpr int maxExponent = 40;
+        static constexpr int numBuckets = 16 + (maxExponent - 4 + 1) * 8;
+
+        static int bucketOf(uint64_t value) noexcept
+        {
+            if (value < 16)
+            {
+                return (int)value;
+            }
+            int exponent = 63 - __builtin_clzll(value);
+            if (exponent > maxExponent)
+            {
+                return numBuckets - 1;
+            }
+            return 16 + (exponent - 4) * 8 + (int)((value >> (exponent - 3)) & 7);
+        }
+
+        /* The middle of the bucket the fraction falls into, never more than the maximum */
+        static double percentile(const uint32_t *snapshot, uint64_t total, double fraction, double maxValue)
+        {
+            if (total == 0)
+            {
+                return 0;
+            }
+            const uint64_t rank = (uint64_t)(fraction * (double)(total - 1));
+            uint64_t seen = 0;
+            int bucket = 0;
+            for (; bucket < numBuckets - 1; bucket++)
+            {
+                seen += snapshot[bucket];
+                if (seen > rank)
+                {
+                    break;
+                }
+            }
+            if (bucket < 16)
+            {
+                return bucket;
+            }
+            const int exponent = 4 + (bucket - 16) / 8;
+            const double lower = (double)((uint64_t)(8 + (bucket - 16) % 8) << (exponent - 3));
+            const double width = (double)((uint64_t)1 << (exponent - 3));
+            return lower + width / 2 < maxValue ? lower + width / 2 : maxValue;
+        }
+
+        std::atomic<uint32_t> counts[numBuckets] = {};
+        std::atomic<uint64_t> max{0};
+    };
+
+    // dumper thread only
+    void dumpIfDue(Clock::time_point time)
+    {
+        if (time < nextDump)
+        {
+            return;
+        }
+        nextDump = time + dumpInterval;
+        dump();
+    }
+
+    void dump()
+    {
+        if (FILE *file = std::fopen(dumpPath.c_str(), "a"))
+        {
+            std::fprintf(file, "%s\n", toJson().c_str());
+            std::fclose(file);
+        }
+    }
+
+    /*
+     * The thread runs while there are instances to dump, it is started by the
+     * first and joined when the last one is removed. The dumper itself is never
+     * destroyed, so nothing is left to do at unload or exit, when the host may
+     * have torn down threads already.
+     */
+    class Dumper
+    {
+    public:
+        static Dumper &get()
+        {
+            static Dumper &dumper = *new Dumper;
+            return dumper;
+        }
+
+        void add(RenderTelemetry *telemetry)
+        {
+            std::lock_guard<std::mutex> running(lifecycle);
+            std::lock_guard<std::mutex> lock(mutex);
+            telemetry->nextDump = Clock::now() + telemetry->dumpInterval;
+            telemetries.push_back(telemetry);
+            if (!thread.joinable())
+            {
+                stopping = false;
+                thread = std::thread([this] { run(); });
+            }
+        }
+
+        void remove(RenderTelemetry *telemetry)
+        {
+            std::lock_guard<std::mutex> running(lifecycle);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                // the last numbers of the instance get written before it goes away
+                telemetry->dump();
+                for (size_t n = 0; n < telemetries.size(); n++)
+                {
+                    if (telemetries[n] == telemetry)
+                    {
+                        telemetries.erase(telemetries.begin() + n);
+                        break;
+                    }
+                }
+                if (!telemetries.empty())
+                {
+                    return;
+                }
+                stopping = true;
+            }
+            wakeup.notify_one();
+            thread.join();
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping)
+            {
+                const Clock::time_point time = Clock::now();
+                for (RenderTelemetry *telemetry : telemetries)
+                {
+                    telemetry->dumpIfDue(time);
+                }
+                wakeup.wait_for(lock, std::chrono::milliseconds(500));
+            }
+        }
+
+        // held while the thread is started or stopped, so an add waits for a stopping thread to be joined
+        std::mutex lifecycle;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::vector<RenderTelemetry *> telemetries;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    const char *name;
+    const std::string dumpPath;
+    const Clock::duration dumpInterval;
+    Clock::time_point nextDump;
+    std::atomic<double> sampleRate{0};
+    std::atomic<uint64_t> numCallbacks{0};
+    std::atomic<uint64_t> numXruns{0};
+    std::atomic<uint64_t> numVoicesStolen{0};
+    Histogram load;
+    Histogram quantumNanos;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#include <stdio.h>
+
+#ifndef WAVHEADER_H_
+#define WAVHEADER_H_
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
+
+// 32 bit samples are written as IEEE float, 16 and 24 bit as integer PCM
+static void writeWavHeader(FILE *fp, int sampleRate, int numChannels, int bitsPerSample, int numFrames) {
+    int byteRate = sampleRate * numChannels * bitsPerSample / 8;
+    int blockAlign = numChannels * bitsPerSample / 8;
+
+    fwrite("RIFF", sizeof(char), 4, fp);
+    int chunkSize = 36 + numFrames * numChannels * bitsPerSample / 8;
+    fwrite(&chunkSize, sizeof(int), 1, fp);
+    fwrite("WAVE", sizeof(char), 4, fp);
+
+    fwrite("fmt ", sizeof(char), 4, fp);
+    int subChunk1Size = 16;
+    fwrite(&subChunk1Size, sizeof(int), 1, fp);
+    short audioFormat = bitsPerSample == 32 ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM;
+    fwrite(&audioFormat, sizeof(short), 1, fp);
+    fwrite(&numChannels, sizeof(short), 1, fp);
+    fwrite(&sampleRate, sizeof(int), 1, fp);
+    fwrite(&byteRate, sizeof(int), 1, fp);
+    fwrite(&blockAlign, sizeof(short), 1, fp);
+    fwrite(&bitsPerSample, sizeof(short), 1, fp);
+
+    fwrite("data", sizeof(char), 4, fp);
+    int subChunk2Size = numFrames * numChannels * bitsPerSample / 8;
+    fwrite(&subChunk2Size, sizeof(int), 1, fp);
+}
+
+#endif  /* WAVHEADER_H_ */
\ No newline at end of file
@@ -0,0 +1,140 @@
+#ifndef AOTCACHE_H
+#define AOTCACHE_H
+
+#include <JuceHeader.h>
+#include <wasmedge/wasmedge.h>
+
+/*
+ * Cache of WasmEdge AOT compiled modules. An entry is named after the SHA-256
+ * of the wasm bytes together with the WasmEdge version and the CPU features
+ * the code was compiled for, so a changed module, a WasmEdge upgrade or a
+ * different machine never picks up a stale library. Entries are written to a
+ * temporary file and renamed, so several plugin instances can share the cache.
+ * Using an entry touches its modification time, and when the cache grows past
+ * maxBytes the least recently used entries are deleted. Temporaries that a
+ * crashed or killed compile left behind are deleted once they are an hour old.
+ */
+class AotCache
+{
+public:
+    explicit AotCache(File directory = getDefaultDirectory(), int64 maxBytes = 256 * 1024 * 1024)
+        : directory(std::move(directory)), maxBytes(maxBytes)
+    {
+    }
+
+    static File getDefaultDirectory()
+    {
+#if JUCE_MAC
+        return File::getSpecialLocation(File::userHomeDirectory).getChildFile("Library/Caches/WasmEdgeSynth");
+#else
+        return File::getSpecialLocation(File::userHomeDirectory).getChildFile(".cache/WasmEdgeSynth");
+#endif
+    }
+
+    /* Where the compiled form of these wasm bytes is or will be */
+    File getEntry(const MemoryBlock &wasm) const
+    {
+        MemoryBlock key(wasm);
+        String environment = String(WasmEdge_VersionGet()) + " " + getCpuFeatures();
+        key.append(environment.toRawUTF8(), environment.getNumBytesAsUTF8());
+        return directory.getChildFile(SHA256(key).toHexString() + ".so");
+    }
+
+    /* Returns true and marks the entry as recently used if it has been compiled */
+    bool lookup(const File &entry) const
+    {
+        if (!entry.existsAsFile())
+        {
+            return false;
+        }
+        entry.setLastModificationTime(Time::getCurrentTime());
+        return true;
+    }
+
+    /* Compiles wasmFile into entry, this takes seconds so call it off the message and audio threads */
+    bool compile(const File &wasmFile, const File &entry)
+    {
+        if (!directory.createDirectory())
+        {
+            return false;
+        }
+        File temporary = entry.withFileExtension(".so.tmp" + String(Random::getSystemRandom().nextInt64()));
+
+        WasmEdge_ConfigureContext *conf = WasmEdge_ConfigureCreate();
+        WasmEdge_ConfigureCompilerSetOptimizationLevel(conf, WasmEdge_CompilerOptimizationLevel_O3);
+        WasmEdge_ConfigureCompilerSetOutputFormat(conf, WasmEdge_CompilerOutputFormat_Native);
+        WasmEdge_CompilerContext *compiler = WasmEdge_CompilerCreate(conf);
+        WasmEdge_Result result = WasmEdge_CompilerCompile(compiler, wasmFile.getFullPathName().toRawUTF8(),
+                                                          temporary.getFullPathName().toRawUTF8());
+        WasmEdge_CompilerDelete(compiler);
+        WasmEdge_ConfigureDelete(conf);
+
+        // another instance may have compiled the same entry meanwhile, the rename replaces it atomically
+        if (!WasmEdge_ResultOK(result) || !temporary.moveFileTo(entry))
+        {
+            temporary.deleteFile();
+            return false;
+        }
+        evict(entry);
+        return true;
+    }
+
+private:
+    static String getCpuFeatures()
+    {
+        StringArray features;
+        features.add(SystemStats::getCpuVendor());
+        features.add(SystemStats::getCpuModel());
+        const std::pair<const char *, bool> flags[] = {
+            {"sse2", SystemStats::hasSSE2()},       {"sse3", SystemStats::hasSSE3()},
+            {"ssse3", SystemStats::hasSSSE3()},     {"sse41", SystemStats::hasSSE41()},
+            {"sse42", SystemStats::hasSSE42()},     {"avx", SystemStats::hasAVX()},
+            {"avx2", SystemStats::hasAVX2()},       {"fma3", SystemStats::hasFMA3()},
+            {"avx512f", SystemStats::hasAVX512F()}, {"neon", SystemStats::hasNeon()},
+        };
+        for (const auto &flag : flags)
+        {
+            if (flag.second)
+            {
+                features.add(flag.first);
+            }
+        }
+        return features.joinIntoString(" ");
+    }
+
+    /* Deletes stale temporaries and the least recently used entries until the cache fits, keeping the one just written */
+    void evict(const File &keep)
+    {
+        // no compile takes an hour, a temporary that old is not being written any more
+        const Time staleBefore = Time::getCurrentTime() - RelativeTime::hours(1);
+        int64 total = 0;
+        for (const File &temporary : directory.findChildFiles(File::findFiles, false, "*.so.tmp*"))
+        {
+            if (temporary.getLastModificationTime() < staleBefore)
+            {
+                temporary.deleteFile();
+                continue;
+            }
+            total += temporary.getSize();
+        }
+
+        Array<File> entries = directory.findChildFiles(File::findFiles, false, "*.so");
+        std::sort(entries.begin(), entries.end(), [](const File &a, const File &b)
+                  { return a.getLastModificationTime() > b.getLastModificationTime(); });
+        for (const File &entry : entries)
+        {
+            int64 size = entry.getSize();
+            if (entry != keep && total + size > maxBytes)
+            {
+                entry.deleteFile();
+                continue;
+            }
+            total += size;
+        }
+    }
+
+    const File directory;
+    const int64 maxBytes;
+};
+
+#endif
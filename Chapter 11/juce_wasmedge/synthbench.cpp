@@ -0,0 +1,488 @@
+#include <wasmedge/wasmedge.h>
+#include "enginecache.h"
+#include "synthengine.h"
+#include "wasm2cengine.h"
+#include "wasmedgeengine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+
+/*
+ * Headless benchmark of the engines WasmEdgeSynth can play with, through the
+ * same SynthEngine implementations: the wasm2c build of the song
+ * (libinstrlib.a from Chapter 09/wasmplugin), and song.wasm in WasmEdge, AOT
+ * compiled and interpreted.
+ *
+ * Every engine renders the same MIDI pattern in host sized blocks, with the
+ * events of a block sent at its start, the way WasmEdgeSynth does it. Results
+ * go to stdout as JSON, one entry per backend and block size, so they can be
+ * collected per commit.
+ *
+ * Every result also says how many heap allocations a block took in the
+ * backend's render path. Where the linker can wrap them (GNU ld, see
+ * CMakeLists.txt) malloc, calloc and realloc are counted, which is what instrlib
+ * and the wasm2c runtime allocate with, elsewhere only operator new. The wasm2c
+ * render path must not allocate at all. WasmEdge's executor builds vectors of
+ * the arguments and results on every call into the module, so once an engine is
+ * instantiated the bare calls for one shortMessage and one renderQuantum are
+ * counted, and a block may take no more than that for each event and quantum
+ * it renders. synthbench exits with 1 if any backend goes over, so an
+ * allocation of our own around the calls (e.g. a WasmEdge_String) is caught.
+ *
+ * With -s it soaks samplerate changes instead: every engine goes through
+ * prepareToPlay's EngineCache and reset path between two samplerates the given
+ * number of times, and the resident memory must stay flat.
+ */
+
+namespace
+{
+std::atomic<long> numAllocations{0};
+}
+
+#ifdef SYNTHBENCH_WRAP_MALLOC
+extern "C"
+{
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_realloc(pointer, size);
+}
+}
+
+// operator new allocates with the wrapped malloc, so it is counted there
+constexpr const char *countedAllocators = "malloc, calloc, realloc";
+#else
+constexpr const char *countedAllocators = "operator new";
+#endif
+
+void *operator new(std::size_t size)
+{
+#ifndef SYNTHBENCH_WRAP_MALLOC
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+#endif
+    if (void *pointer = std::malloc(size ? size : 1))
+    {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace
+{
+double nowSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t residentBytes()
+{
+#if defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+    {
+        return 0;
+    }
+    return info.resident_size;
+#else
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/*
+ * A note on a different channel every 125 ms, held for 500 ms, so there are
+ * always a few voices and every channel the song defines gets played.
+ */
+struct MidiPattern
+{
+    explicit MidiPattern(float samplerate)
+        : interval((int)(samplerate / 8)), length((int)(samplerate / 2))
+    {
+    }
+
+    template <typename Send>
+    void sendEvents(int64_t start, int numFrames, Send send) const
+    {
+        int64_t first = (start + interval - 1) / interval;
+        for (int64_t step = first; step * interval < start + numFrames; step++)
+        {
+            send(0x90 | (int)(step % 16), 48 + (int)(step * 7 % 36), 100);
+        }
+        first = (start - length + interval - 1) / interval;
+        for (int64_t step = std::max<int64_t>(first, 0); step * interval + length < start + numFrames; step++)
+        {
+            send(0x80 | (int)(step % 16), 48 + (int)(step * 7 % 36), 0);
+        }
+    }
+
+    const int interval;
+    const int length;
+};
+
+struct Result
+{
+    double instantiateMillis;
+    double nsPerSample;
+    double p50Micros;
+    double p99Micros;
+    double maxMicros;
+    double allocationsPerBlock;
+    // what WasmEdge's calls into the module allocate by themselves, see the top of this file
+    double allowedAllocationsPerBlock;
+    long rssKib;
+};
+
+/* The allocations of one call, after a first one that may still set things up */
+template <typename Call>
+long countCallAllocations(Call call)
+{
+    call();
+    long before = numAllocations.load(std::memory_order_relaxed);
+    call();
+    return numAllocations.load(std::memory_order_relaxed) - before;
+}
+
+bool run(SynthEngine &engine, float samplerate, int blockSize, double seconds, Result &result)
+{
+    size_t rssBefore = residentBytes();
+    double createStart = nowSeconds();
+    if (!engine.instantiate(samplerate))
+    {
+        return false;
+    }
+    result.instantiateMillis = (nowSeconds() - createStart) * 1e3;
+    long shortMessageAllocations = 0;
+    long quantumAllocations = 0;
+    if (auto *wasmEdge = dynamic_cast<WasmEdgeEngine *>(&engine))
+    {
+        // a note off for a note that is not playing
+        shortMessageAllocations = countCallAllocations([&] { wasmEdge->invokeShortMessage(0x80, 0, 0); });
+        quantumAllocations = countCallAllocations([&] { wasmEdge->invokeFillSampleBuffer(SynthEngine::quantumFrames); });
+    }
+
+    MidiPattern pattern(samplerate);
+    std::vector<float> left(blockSize), right(blockSize);
+    int numBlocks = (int)(seconds * samplerate / blockSize) + 1;
+    std::vector<double> callbackTimes(numBlocks);
+    double total = 0;
+    long numEvents = 0;
+    long allocationsBefore = numAllocations.load(std::memory_order_relaxed);
+    for (int block = 0; block < numBlocks; block++)
+    {
+        double start = nowSeconds();
+        pattern.sendEvents((int64_t)block * blockSize, blockSize,
+                           [&](int status, int data1, int data2)
+                           {
+                               engine.shortMessage(status, data1, data2);
+                               numEvents++;
+                           });
+        engine.render(left.data(), right.data(), blockSize, 1.0f);
+        callbackTimes[block] = nowSeconds() - start;
+        total += callbackTimes[block];
+    }
+    result.allocationsPerBlock = (double)(numAllocations.load(std::memory_order_relaxed) - allocationsBefore) / numBlocks;
+    const long numQuanta = (long)numBlocks * ((blockSize + SynthEngine::quantumFrames - 1) / SynthEngine::quantumFrames);
+    result.allowedAllocationsPerBlock =
+        (double)(numEvents * shortMessageAllocations + numQuanta * quantumAllocations) / numBlocks;
+    result.rssKib = ((long)residentBytes() - (long)rssBefore) / 1024;
+
+    std::sort(callbackTimes.begin(), callbackTimes.end());
+    result.nsPerSample = total * 1e9 / ((double)numBlocks * blockSize);
+    result.p50Micros = callbackTimes[numBlocks / 2] * 1e6;
+    result.p99Micros = callbackTimes[std::min(numBlocks - 1, numBlocks * 99 / 100)] * 1e6;
+    result.maxMicros = callbackTimes[numBlocks - 1] * 1e6;
+    return true;
+}
+
+// allocator and page cache noise, a leaked instance is several MiB
+constexpr long soakRssToleranceKib = 1024;
+
+struct SoakResult
+{
+    int instantiations;
+    double p50Micros;
+    double p99Micros;
+    double maxMicros;
+    long rssStartKib;
+    long rssEndKib;
+};
+
+/*
+ * Switches between samplerate and another one toggles times the way
+ * WasmEdgeSynth's prepareToPlay does, with a note and a block rendered at each
+ * so that every reset has state to undo. Only the first switch to each
+ * samplerate should instantiate.
+ */
+bool soak(const std::function<std::unique_ptr<SynthEngine>()> &createEngine, float samplerate, int toggles,
+          SoakResult &result)
+{
+    const float samplerates[2] = {samplerate, samplerate == 48000 ? 44100.0f : 48000.0f};
+    const int blockSize = 512;
+    EngineCache<SynthEngine> cache(4);
+    std::unique_ptr<SynthEngine> engine;
+    std::vector<float> left(blockSize), right(blockSize);
+    std::vector<double> switchTimes(toggles);
+    result.instantiations = 0;
+    result.rssStartKib = 0;
+    for (int toggle = 0; toggle < toggles; toggle++)
+    {
+        // both samplerates have their engine by now, memory should not grow beyond this
+        if (toggle == 2)
+        {
+            result.rssStartKib = (long)(residentBytes() / 1024);
+        }
+        const float previous = samplerates[(toggle + 1) % 2];
+        const float next = samplerates[toggle % 2];
+        double start = nowSeconds();
+        cache.put(previous, std::move(engine));
+        engine = cache.take(next);
+        if (engine == nullptr || !engine->reset())
+        {
+            engine = createEngine();
+            result.instantiations++;
+            if (!engine->instantiate(next))
+            {
+                return false;
+            }
+        }
+        switchTimes[toggle] = nowSeconds() - start;
+        engine->shortMessage(0x90, 60 + toggle % 12, 100);
+        engine->render(left.data(), right.data(), blockSize, 1.0f);
+    }
+    result.rssEndKib = (long)(residentBytes() / 1024);
+
+    std::sort(switchTimes.begin(), switchTimes.end());
+    result.p50Micros = switchTimes[toggles / 2] * 1e6;
+    result.p99Micros = switchTimes[std::min(toggles - 1, toggles * 99 / 100)] * 1e6;
+    result.maxMicros = switchTimes[toggles - 1] * 1e6;
+    return true;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-r samplerate] [-d seconds] [-b blocksize] [-s toggles] [-l label] song.wasm\n"
+            "  renders a MIDI pattern with wasm2c, WasmEdge AOT and the WasmEdge interpreter\n"
+            "  at block sizes 32 to 4096 and writes the timings and heap allocations per block\n"
+            "  as JSON to stdout, exits with 1 if the wasm2c backend allocated while rendering\n"
+            "  or WasmEdge more than its calls into the module do by themselves\n"
+            "  -r  samplerate (default 44100)\n"
+            "  -d  seconds to render per backend and block size (default 2)\n"
+            "  -b  only this block size\n"
+            "  -s  instead, switch every engine between two samplerates this many times\n"
+            "      (e.g. 10000) and report switch times and resident memory, exits with 1\n"
+            "      if that grew by more than %ld KiB\n"
+            "  -l  label for the run, e.g. the commit\n"
+            "  the wasm2c backend is the song linked in from libinstrlib.a, song.wasm should be\n"
+            "  the file it was converted from\n",
+            name, soakRssToleranceKib);
+}
+}
+
+int main(int argc, char **argv)
+{
+    float samplerate = 44100;
+    double seconds = 2;
+    int onlyBlockSize = 0;
+    int soakToggles = 0;
+    const char *label = "";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:b:s:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            samplerate = atof(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'b':
+            onlyBlockSize = atoi(optarg);
+            break;
+        case 's':
+            soakToggles = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1 || samplerate <= 0 || seconds <= 0 || onlyBlockSize < 0 || soakToggles < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    const std::string songPath = argv[optind];
+    const std::string aotPath = songPath + ".so";
+
+    // compiled once up front like WasmEdgeSynth does, so it is not part of instantiation
+    double compileStart = nowSeconds();
+    WasmEdge_ConfigureContext *conf = WasmEdge_ConfigureCreate();
+    WasmEdge_ConfigureCompilerSetOptimizationLevel(conf, WasmEdge_CompilerOptimizationLevel_O3);
+    WasmEdge_CompilerContext *compiler = WasmEdge_CompilerCreate(conf);
+    WasmEdge_Result compiled = WasmEdge_CompilerCompile(compiler, songPath.c_str(), aotPath.c_str());
+    WasmEdge_CompilerDelete(compiler);
+    WasmEdge_ConfigureDelete(conf);
+    double compileMillis = (nowSeconds() - compileStart) * 1e3;
+    if (!WasmEdge_ResultOK(compiled))
+    {
+        fprintf(stderr, "AOT compiling %s failed: %s\n", songPath.c_str(), WasmEdge_ResultGetMessage(compiled));
+        return 1;
+    }
+
+    // a fresh engine per run, so that every measurement starts from instantiation
+    const std::function<std::unique_ptr<SynthEngine>()> engines[] = {
+        [] { return std::make_unique<Wasm2cEngine>(); },
+        [&] { return std::make_unique<WasmEdgeEngine>(aotPath, false); },
+        [&] { return std::make_unique<WasmEdgeEngine>(songPath, true); },
+    };
+
+    if (soakToggles > 0)
+    {
+        printf("{\n  \"label\": \"%s\",\n  \"song\": \"%s\",\n  \"samplerate\": %.0f,\n  \"toggles\": %d,\n", label,
+               songPath.c_str(), samplerate, soakToggles);
+        printf("  \"soak\": [");
+        int status = 0;
+        const char *separator = "\n";
+        for (const auto &createEngine : engines)
+        {
+            SoakResult result = {};
+            const std::string name = createEngine()->getName();
+            if (!soak(createEngine, samplerate, soakToggles, result))
+            {
+                fprintf(stderr, "%s could not be instantiated\n", name.c_str());
+                status = 1;
+                continue;
+            }
+            const bool flat = soakToggles <= 2 || result.rssEndKib - result.rssStartKib <= soakRssToleranceKib;
+            status |= flat ? 0 : 1;
+            printf("%s    {\"backend\": \"%s\", \"instantiations\": %d, \"switch_us\": {\"p50\": %.2f, \"p99\": %.2f, "
+                   "\"max\": %.2f}, \"rss_kib_start\": %ld, \"rss_kib_end\": %ld, \"rss_flat\": %s}",
+                   separator, name.c_str(), result.instantiations, result.p50Micros, result.p99Micros, result.maxMicros,
+                   result.rssStartKib, result.rssEndKib, flat ? "true" : "false");
+            separator = ",\n";
+            fflush(stdout);
+        }
+        printf("\n  ]\n}\n");
+        return status;
+    }
+
+    std::vector<int> blockSizes;
+    for (int blockSize = 32; blockSize <= 4096; blockSize *= 2)
+    {
+        if (onlyBlockSize == 0 || onlyBlockSize == blockSize)
+        {
+            blockSizes.push_back(blockSize);
+        }
+    }
+    if (onlyBlockSize != 0 && blockSizes.empty())
+    {
+        blockSizes.push_back(onlyBlockSize);
+    }
+
+    printf("{\n  \"label\": \"%s\",\n  \"song\": \"%s\",\n  \"samplerate\": %.0f,\n  \"seconds\": %g,\n", label,
+           songPath.c_str(), samplerate, seconds);
+    printf("  \"aot_compile_ms\": %.1f,\n  \"counted_allocators\": \"%s\",\n  \"results\": [", compileMillis,
+           countedAllocators);
+    int status = 0;
+    const char *separator = "\n";
+    for (const auto &createEngine : engines)
+    {
+        for (int blockSize : blockSizes)
+        {
+            Result result;
+            std::unique_ptr<SynthEngine> engine = createEngine();
+            if (!run(*engine, samplerate, blockSize, seconds, result))
+            {
+                fprintf(stderr, "%s could not be instantiated\n", engine->getName());
+                status = 1;
+                break;
+            }
+            printf("%s    {\"backend\": \"%s\", \"block_size\": %d, \"instantiate_ms\": %.3f, \"ns_per_sample\": %.2f, "
+                   "\"callback_us\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}, \"allocations_per_block\": %.2f, "
+                   "\"allowed_allocations_per_block\": %.2f, \"rss_kib\": %ld}",
+                   separator, engine->getName(), blockSize, result.instantiateMillis, result.nsPerSample,
+                   result.p50Micros, result.p99Micros, result.maxMicros, result.allocationsPerBlock,
+                   result.allowedAllocationsPerBlock, result.rssKib);
+            separator = ",\n";
+            fflush(stdout);
+            // only WasmEdge allocates in its calls into the module, see the top of this file
+            if (result.allocationsPerBlock > result.allowedAllocationsPerBlock)
+            {
+                fprintf(stderr, "%s allocated %.2f times per block of %d, %.2f are allowed\n", engine->getName(),
+                        result.allocationsPerBlock, blockSize, result.allowedAllocationsPerBlock);
+                status = 1;
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return status;
+}
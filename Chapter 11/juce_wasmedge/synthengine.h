@@ -0,0 +1,88 @@
+#ifndef SYNTHENGINE_H
+#define SYNTHENGINE_H
+
+#include "mixkernels.h"
+
+#include <algorithm>
+#include <cstdint>
+
+/*
+ * One instance of the song's synth module, whichever runtime executes it. The
+ * engines are Wasm2cEngine (the wasm2c build linked in from instrlib) and
+ * WasmEdgeEngine, which runs song.wasm AOT compiled or in the interpreter.
+ * WasmEdgeSynth plays through this interface and synthbench measures it, so
+ * the cost of one engine against another is a choice of engine and nothing
+ * else.
+ *
+ * instantiate runs off the audio thread. Everything else is for the thread
+ * that renders, one thread at a time.
+ */
+class SynthEngine
+{
+public:
+    enum Type
+    {
+        wasm2c,
+        wasmEdgeAot,
+        wasmEdgeInterpreter
+    };
+
+    /* One entry of the module's getActiveVoicesStatusSnapshot */
+    struct Voice
+    {
+        uint8_t channel;
+        uint8_t note;
+        uint8_t velocity;
+    };
+
+    static constexpr int quantumFrames = 128;
+
+    virtual ~SynthEngine() = default;
+
+    virtual Type getType() const = 0;
+    virtual const char *getName() const = 0;
+
+    /* Creates the instance for sampleRate, false if that failed */
+    virtual bool instantiate(float sampleRate) = 0;
+
+    /*
+     * Off the audio thread: puts the instance back into the state instantiate
+     * left it in, at less cost than instantiating again. False if that failed,
+     * the engine is then of no use.
+     */
+    virtual bool reset() = 0;
+
+    virtual void shortMessage(uint8_t status, uint8_t data1, uint8_t data2) = 0;
+
+    /* Runs the synth for numFrames (at most quantumFrames) into the sample buffer, false if the module failed */
+    virtual bool renderQuantum(int numFrames) = 0;
+
+    /* The last rendered quantum, quantumFrames of the left channel followed by the right */
+    virtual const float *getSampleBuffer() = 0;
+
+    /* Positions the song that is compiled into the module at millis */
+    virtual void seek(double millis) = 0;
+
+    /* Copies up to maxVoices of the voices that are playing into voices and returns how many are playing */
+    virtual int getActiveVoices(Voice *voices, int maxVoices) = 0;
+
+    /*
+     * Renders any number of frames into planar host buffers, scaled by gain.
+     * Engines that can skip work, like instrlib's idle bypass, override it.
+     */
+    virtual bool render(float *left, float *right, int numFrames, float gain)
+    {
+        bool ok = true;
+        for (int frame = 0; frame < numFrames; frame += quantumFrames)
+        {
+            int numFramesToRender = std::min(numFrames - frame, quantumFrames);
+            ok &= renderQuantum(numFramesToRender);
+            const float *renderbuf = getSampleBuffer();
+            mix_copy_gain(left + frame, renderbuf, gain, numFramesToRender);
+            mix_copy_gain(right + frame, renderbuf + quantumFrames, gain, numFramesToRender);
+        }
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef WASM2CENGINE_H
+#define WASM2CENGINE_H
+
+#include "instrlib.h"
+#include "synthengine.h"
+
+#include <type_traits>
+
+/* The song converted by wasm2c, from libinstrlib.a (Chapter 09/wasmplugin) */
+class Wasm2cEngine final : public SynthEngine
+{
+public:
+    ~Wasm2cEngine() override
+    {
+        instrlib_destroy(instrlib);
+    }
+
+    Type getType() const override { return wasm2c; }
+    const char *getName() const override { return "wasm2c"; }
+
+    bool instantiate(float sampleRate) override
+    {
+        instrlib_destroy(instrlib);
+        // as in WasmSynth: the synth never grows beyond a few pages, so rendering neither grows nor faults
+        instrlib_memory_options_t memoryOptions = {INSTRLIB_MEMORY_RESERVED, INSTRLIB_MEMORY_LOCKED, 64};
+        instrlib = instrlib_create_with_memory(sampleRate, &memoryOptions);
+        return instrlib != nullptr;
+    }
+
+    bool reset() override
+    {
+        return instrlib != nullptr && instrlib_reset(instrlib);
+    }
+
+    void shortMessage(uint8_t status, uint8_t data1, uint8_t data2) override
+    {
+        instrlib_shortMessage(instrlib, status, data1, data2);
+    }
+
+    bool renderQuantum(int numFrames) override
+    {
+        instrlib_fillsamplebufferwithnumsamples(instrlib, numFrames);
+        return true;
+    }
+
+    const float *getSampleBuffer() override
+    {
+        return instrlib_getSampleBuffer(instrlib);
+    }
+
+    void seek(double millis) override
+    {
+        instrlib_seek(instrlib, millis);
+    }
+
+    int getActiveVoices(Voice *voices, int maxVoices) override
+    {
+        static_assert(sizeof(Voice) == sizeof(instrlib_voice_t) && std::is_standard_layout<Voice>::value,
+                      "Voice is instrlib_voice_t");
+        return instrlib_getActiveVoices(instrlib, reinterpret_cast<instrlib_voice_t *>(voices), maxVoices);
+    }
+
+    bool render(float *left, float *right, int numFrames, float gain) override
+    {
+        instrlib_render(instrlib, left, right, numFrames, gain, false);
+        return true;
+    }
+
+private:
+    instrlib_t *instrlib = nullptr;
+};
+
+#endif
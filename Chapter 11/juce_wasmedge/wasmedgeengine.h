@@ -0,0 +1,250 @@
+#ifndef WASMEDGEENGINE_H
+#define WASMEDGEENGINE_H
+
+#include <wasmedge/wasmedge.h>
+#include "synthengine.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+/*
+ * The song in a WasmEdge VM, loaded either from an AOT compiled library or
+ * from the wasm file into the interpreter.
+ *
+ * The VM only loads and instantiates. The exports the audio thread calls are
+ * resolved to function instances up front and invoked through an executor
+ * with argument arrays that are members, so there are no name lookups and no
+ * WasmEdge_String allocations per call. The sample buffer pointer is looked up
+ * again whenever the linear memory has grown.
+ *
+ * reset instantiates the module that the VM has already loaded and validated
+ * once more, against the environment module that is already registered.
+ */
+class WasmEdgeEngine final : public SynthEngine
+{
+public:
+    WasmEdgeEngine(std::string path, bool interpreted)
+        : path(std::move(path)), interpreted(interpreted)
+    {
+    }
+
+    ~WasmEdgeEngine() override
+    {
+        release();
+    }
+
+    Type getType() const override { return interpreted ? wasmEdgeInterpreter : wasmEdgeAot; }
+    const char *getName() const override { return interpreted ? "wasmedge-interpreter" : "wasmedge-aot"; }
+
+    bool instantiate(float sampleRate) override
+    {
+        release();
+        WasmEdge_ConfigureContext *conf = WasmEdge_ConfigureCreate();
+        WasmEdge_ConfigureSetForceInterpreter(conf, interpreted);
+        vm_cxt = WasmEdge_VMCreate(conf, NULL);
+        executor = WasmEdge_ExecutorCreate(conf, NULL);
+        WasmEdge_ConfigureDelete(conf);
+
+        // the module and global instances copy the names and the type, they are freed right away
+        WasmEdge_String environmentName = WasmEdge_StringCreateByCString("environment");
+        environmentModuleInstanceContext = WasmEdge_ModuleInstanceCreate(environmentName);
+        WasmEdge_StringDelete(environmentName);
+        WasmEdge_GlobalTypeContext *SAMPLERATE_type = WasmEdge_GlobalTypeCreate(WasmEdge_ValType_F32, WasmEdge_Mutability_Const);
+        WasmEdge_GlobalInstanceContext *SAMPLERATE_global = WasmEdge_GlobalInstanceCreate(SAMPLERATE_type, WasmEdge_ValueGenF32(sampleRate));
+        WasmEdge_String samplerateName = WasmEdge_StringCreateByCString("SAMPLERATE");
+        WasmEdge_ModuleInstanceAddGlobal(environmentModuleInstanceContext, samplerateName, SAMPLERATE_global);
+        WasmEdge_StringDelete(samplerateName);
+        WasmEdge_GlobalTypeDelete(SAMPLERATE_type);
+        WasmEdge_VMRegisterModuleFromImport(vm_cxt, environmentModuleInstanceContext);
+
+        WasmEdge_Result result = WasmEdge_VMLoadWasmFromFile(vm_cxt, path.c_str());
+        printf("Loaded %s%s, result: %d\n", path.c_str(), interpreted ? " into the interpreter" : "", result.Code);
+        if (!WasmEdge_ResultOK(result) || !WasmEdge_ResultOK(WasmEdge_VMValidate(vm_cxt)))
+        {
+            printf("Wasm module could not be instantiated\n");
+            return false;
+        }
+        return instantiateModule();
+    }
+
+    bool reset() override
+    {
+        return vm_cxt != nullptr && instantiateModule();
+    }
+
+    void shortMessage(uint8_t status, uint8_t data1, uint8_t data2) override
+    {
+        invokeShortMessage(status, data1, data2);
+        checkMemoryGrowth();
+    }
+
+    bool renderQuantum(int numFrames) override
+    {
+        lastResult = invokeFillSampleBuffer(numFrames);
+        checkMemoryGrowth();
+        return WasmEdge_ResultOK(lastResult);
+    }
+
+    /*
+     * The calls into the module alone, without what shortMessage and
+     * renderQuantum do around them, so that synthbench can tell what WasmEdge
+     * allocates per call from what the engine adds.
+     */
+    WasmEdge_Result invokeShortMessage(uint8_t status, uint8_t data1, uint8_t data2)
+    {
+        shortMessageArgs[0] = WasmEdge_ValueGenI32(status);
+        shortMessageArgs[1] = WasmEdge_ValueGenI32(data1);
+        shortMessageArgs[2] = WasmEdge_ValueGenI32(data2);
+        return WasmEdge_ExecutorInvoke(executor, shortMessageFunc, shortMessageArgs, 3, NULL, 0);
+    }
+
+    WasmEdge_Result invokeFillSampleBuffer(int numFrames)
+    {
+        fillSampleBufferArgs[0] = WasmEdge_ValueGenI32((uint32_t)numFrames);
+        return WasmEdge_ExecutorInvoke(executor, fillSampleBufferFunc, fillSampleBufferArgs, 1, NULL, 0);
+    }
+
+    const float *getSampleBuffer() override { return renderbuf; }
+
+    void seek(double millis) override
+    {
+        seekArgs[0] = WasmEdge_ValueGenI32((uint32_t)millis);
+        WasmEdge_ExecutorInvoke(executor, seekFunc, seekArgs, 1, NULL, 0);
+        checkMemoryGrowth();
+        // the module seeks with millisecond resolution, the clock gets the exact value as in instrlib_seek
+        WasmEdge_GlobalInstanceSetValue(currentTimeMillis, WasmEdge_ValueGenF64(millis));
+    }
+
+    int getActiveVoices(Voice *voices, int maxVoices) override
+    {
+        WasmEdge_Value snapshot;
+        if (!WasmEdge_ResultOK(WasmEdge_ExecutorInvoke(executor, voicesStatusFunc, NULL, 0, &snapshot, 1)))
+        {
+            return 0;
+        }
+        checkMemoryGrowth();
+        // a StaticArray<u8> with channel, note and velocity of every voice slot, all zero when the slot is free
+        uint32_t address = WasmEdge_ValueGetI32(snapshot);
+        const uint8_t *lengthBytes = WasmEdge_MemoryInstanceGetPointerConst(memCtx, address - 4, 4);
+        if (lengthBytes == nullptr)
+        {
+            return 0;
+        }
+        uint32_t length;
+        memcpy(&length, lengthBytes, sizeof(length));
+        const uint8_t *data = WasmEdge_MemoryInstanceGetPointerConst(memCtx, address, length);
+        if (data == nullptr)
+        {
+            return 0;
+        }
+        int numActive = 0;
+        for (uint32_t slot = 0; slot + 2 < length; slot += 3)
+        {
+            if (data[slot + 1] == 0 && data[slot + 2] == 0)
+            {
+                continue;
+            }
+            if (numActive < maxVoices)
+            {
+                voices[numActive] = {data[slot], data[slot + 1], data[slot + 2]};
+            }
+            numActive++;
+        }
+        return numActive;
+    }
+
+    /* Why the last renderQuantum failed */
+    WasmEdge_Result getLastResult() const { return lastResult; }
+
+private:
+    /* A new instance of the loaded module, replacing the previous one, and its exports */
+    bool instantiateModule()
+    {
+        renderbuf = nullptr;
+        if (!WasmEdge_ResultOK(WasmEdge_VMInstantiate(vm_cxt)))
+        {
+            printf("Wasm module could not be instantiated\n");
+            return false;
+        }
+
+        const WasmEdge_ModuleInstanceContext *moduleCtx = WasmEdge_VMGetActiveModule(vm_cxt);
+        WasmEdge_GlobalInstanceContext *globCtx = findExport(moduleCtx, "samplebuffer", WasmEdge_ModuleInstanceFindGlobal);
+        currentTimeMillis = findExport(moduleCtx, "currentTimeMillis", WasmEdge_ModuleInstanceFindGlobal);
+        memCtx = findExport(moduleCtx, "memory", WasmEdge_ModuleInstanceFindMemory);
+        shortMessageFunc = findExport(moduleCtx, "shortmessage", WasmEdge_ModuleInstanceFindFunction);
+        fillSampleBufferFunc = findExport(moduleCtx, "fillSampleBufferWithNumSamples", WasmEdge_ModuleInstanceFindFunction);
+        seekFunc = findExport(moduleCtx, "seek", WasmEdge_ModuleInstanceFindFunction);
+        voicesStatusFunc = findExport(moduleCtx, "getActiveVoicesStatusSnapshot", WasmEdge_ModuleInstanceFindFunction);
+        if (!globCtx || !currentTimeMillis || !memCtx || !shortMessageFunc || !fillSampleBufferFunc || !seekFunc || !voicesStatusFunc)
+        {
+            printf("Wasm module lacks the synth exports\n");
+            return false;
+        }
+
+        sampleBufferAddrValue = WasmEdge_ValueGetI32(WasmEdge_GlobalInstanceGetValue(globCtx));
+        updateSampleBuffer();
+        return renderbuf != nullptr;
+    }
+
+    template <typename Instance>
+    static Instance *findExport(const WasmEdge_ModuleInstanceContext *moduleCtx, const char *name,
+                                Instance *(*find)(const WasmEdge_ModuleInstanceContext *, const WasmEdge_String))
+    {
+        WasmEdge_String nameString = WasmEdge_StringCreateByCString(name);
+        Instance *instance = find(moduleCtx, nameString);
+        WasmEdge_StringDelete(nameString);
+        return instance;
+    }
+
+    /* Any call may run memory.grow, after which the old pointer is not to be trusted */
+    void checkMemoryGrowth()
+    {
+        if (WasmEdge_MemoryInstanceGetPageSize(memCtx) != memoryPages)
+        {
+            updateSampleBuffer();
+        }
+    }
+
+    void updateSampleBuffer()
+    {
+        memoryPages = WasmEdge_MemoryInstanceGetPageSize(memCtx);
+        renderbuf = (const float *)WasmEdge_MemoryInstanceGetPointerConst(memCtx, sampleBufferAddrValue, quantumFrames * 2 * 4);
+    }
+
+    void release()
+    {
+        WasmEdge_ExecutorDelete(executor);
+        WasmEdge_VMDelete(vm_cxt);
+        WasmEdge_ModuleInstanceDelete(environmentModuleInstanceContext);
+        executor = nullptr;
+        vm_cxt = nullptr;
+        environmentModuleInstanceContext = nullptr;
+        memCtx = nullptr;
+        renderbuf = nullptr;
+    }
+
+    const std::string path;
+    const bool interpreted;
+    WasmEdge_VMContext *vm_cxt = nullptr;
+    WasmEdge_ExecutorContext *executor = nullptr;
+    WasmEdge_ModuleInstanceContext *environmentModuleInstanceContext = nullptr;
+    WasmEdge_FunctionInstanceContext *shortMessageFunc = nullptr;
+    WasmEdge_FunctionInstanceContext *fillSampleBufferFunc = nullptr;
+    WasmEdge_FunctionInstanceContext *seekFunc = nullptr;
+    WasmEdge_FunctionInstanceContext *voicesStatusFunc = nullptr;
+    WasmEdge_GlobalInstanceContext *currentTimeMillis = nullptr;
+    WasmEdge_MemoryInstanceContext *memCtx = nullptr;
+    WasmEdge_Value shortMessageArgs[3] = {};
+    WasmEdge_Value fillSampleBufferArgs[1] = {};
+    WasmEdge_Value seekArgs[1] = {};
+    WasmEdge_Result lastResult = WasmEdge_Result_Success;
+    uint32_t sampleBufferAddrValue = 0;
+    uint32_t memoryPages = 0;
+    const float *renderbuf = nullptr;
+
+    WasmEdgeEngine(const WasmEdgeEngine &) = delete;
+    WasmEdgeEngine &operator=(const WasmEdgeEngine &) = delete;
+};
+
+#endif
@@ -1,24 +1,33 @@
 #include <JuceHeader.h>
-#include <wasmedge/wasmedge.h>
+#include "aotcache.h"
+#include "enginecache.h"
+#include "governor.h"
+#include "hotreload.h"
+#include "rtlog.h"
+#include "synthengine.h"
+#include "telemetry.h"
+#include "wasm2cengine.h"
+#include "wasmedgeengine.h"
 
+/*
+ * The synth with a choice of engine: the wasm2c build linked in from instrlib,
+ * song.wasm AOT compiled by WasmEdge, or song.wasm in the WasmEdge interpreter.
+ * The engine parameter switches between them while playing, the new engine is
+ * built on the reloader's thread and crossfaded to like a reloaded song.
+ * WASMEDGESYNTH_ENGINE (wasm2c, aot or interpreter) sets the default.
+ */
 class WasmEdgeSynth final : public AudioProcessor
 {
 public:
     WasmEdgeSynth()
         : AudioProcessor(BusesProperties().withOutput("Output", AudioChannelSet::stereo()))
     {
-        WasmEdge_ConfigureContext *ConfCxt = WasmEdge_ConfigureCreate();
-
-        WasmEdge_CompilerContext *CompilerCxt = WasmEdge_CompilerCreate(ConfCxt);
-        WasmEdge_CompilerCompile(CompilerCxt, "/Users/peter/song.wasm", "/Users/peter/song.wasm.so");
-
-        WasmEdge_CompilerDelete(CompilerCxt);
-        WasmEdge_ConfigureDelete(ConfCxt);
-
-        vm_cxt = WasmEdge_VMCreate(NULL, NULL);
-        WasmEdge_Result result = WasmEdge_VMLoadWasmFromFile(vm_cxt, "/Users/peter/song.wasm.so");
+        addParameter(engineParameter = new AudioParameterChoice("engine", "Engine", engineNames, getDefaultEngine()));
+    }
 
-        printf("Loaded Wasm file, result: %d\n", result.Code);
+    ~WasmEdgeSynth() override
+    {
+        delete fadingOut;
     }
 
     static String getIdentifier()
@@ -26,103 +35,304 @@ public:
         return "WasmEdge Synth";
     }
 
-    void prepareToPlay(double newSampleRate, int) override
+    void prepareToPlay(double newSampleRate, int maximumExpectedSamplesPerBlock) override
     {
         synth.setCurrentPlaybackSampleRate(newSampleRate);
         printf("Samplerate is %f\n", newSampleRate);
+        telemetry.prepare(newSampleRate);
+        governor.reset();
+        lastCallbackLoad = 0;
+        reloader.discardPending();
+        keepEngine();
+        preparedSampleRate = newSampleRate;
+        fadeBuffer.setSize(2, jmax(maximumExpectedSamplesPerBlock, 128));
+        fadeLength = (int)(newSampleRate * 0.02);
 
-        if (environmentModuleInstanceContext != NULL) {
-            WasmEdge_ModuleInstanceDelete(environmentModuleInstanceContext);
+        requestedEngine = engineParameter->getIndex();
+        // switching to a samplerate that was played before is a pointer swap and a reset, not a new VM
+        engine = engineCache.take(newSampleRate);
+        if (engine == nullptr || !engine->reset())
+        {
+            engine = createEngine((SynthEngine::Type)requestedEngine, newSampleRate, false);
         }
-        environmentModuleInstanceContext = WasmEdge_ModuleInstanceCreate(WasmEdge_StringCreateByCString("environment"));
-        WasmEdge_VMRegisterModuleFromImport(vm_cxt, environmentModuleInstanceContext);
-       
-        WasmEdge_GlobalTypeContext *SAMPLERATE_type = WasmEdge_GlobalTypeCreate(WasmEdge_ValType_F32, WasmEdge_Mutability_Const);
-        WasmEdge_GlobalInstanceContext *SAMPLERATE_global = WasmEdge_GlobalInstanceCreate(SAMPLERATE_type, WasmEdge_ValueGenF32(newSampleRate));
-        WasmEdge_ModuleInstanceAddGlobal(environmentModuleInstanceContext, WasmEdge_StringCreateByCString("SAMPLERATE"), SAMPLERATE_global);
+        if (engine && engine->getType() != requestedEngine)
+        {
+            // compiling takes seconds, the interpreter plays until the reloader swaps in the compiled module
+            printf("Compiling %s in the background\n", songFile.getFullPathName().toRawUTF8());
+            reloader.requestReload();
+        }
+        printf("Prepare completed\n");
+    }
 
-        WasmEdge_VMValidate(vm_cxt);
-        printf("Wasm module validatedf\n");
-        WasmEdge_VMInstantiate(vm_cxt);
+    void releaseResources() override
+    {
+        reloader.discardPending();
+        keepEngine();
+        preparedSampleRate = 0;
+    }
 
-        printf("Wasm module instantiated\n");
+    void processBlock(AudioBuffer<float> &buffer, MidiBuffer &midiMessages) override
+    {
+        const auto callbackStart = RenderTelemetry::now();
+        renderBlock(buffer, midiMessages);
+        lastCallbackLoad = telemetry.callbackFinished(callbackStart, buffer.getNumSamples());
+    }
 
-        const WasmEdge_ModuleInstanceContext *moduleCtx = WasmEdge_VMGetActiveModule(vm_cxt);
-        WasmEdge_GlobalInstanceContext *globCtx = WasmEdge_ModuleInstanceFindGlobal(moduleCtx, WasmEdge_StringCreateByCString("samplebuffer"));
-        WasmEdge_MemoryInstanceContext *memCtx = WasmEdge_ModuleInstanceFindMemory(moduleCtx, WasmEdge_StringCreateByCString("memory"));
+    using AudioProcessor::processBlock;
 
-        fillSampleBufferFuncNameString = WasmEdge_StringCreateByCString("fillSampleBufferWithNumSamples");
-        WasmEdge_Value globValue = WasmEdge_GlobalInstanceGetValue(globCtx);
-        uint32_t sampleBufferAddrValue = WasmEdge_ValueGetI32(globValue);
+    /* Callback load, xruns and render times of this instance, for any thread to poll */
+    const RenderTelemetry &getTelemetry() const { return telemetry; }
 
-        const uint8_t *renderbytebuf = WasmEdge_MemoryInstanceGetPointer(memCtx, sampleBufferAddrValue, 128 * 2 * 4);
-        renderbuf = (float32_t *)renderbytebuf;
-        printf("Wasm module exports stored\n");
+    const String getName() const override { return getIdentifier(); }
+    double getTailLengthSeconds() const override { return 0.0; }
+    bool acceptsMidi() const override { return true; }
+    bool producesMidi() const override { return true; }
+    AudioProcessorEditor *createEditor() override { return nullptr; }
+    bool hasEditor() const override { return false; }
+    int getNumPrograms() override { return 1; }
+    int getCurrentProgram() override { return 0; }
+    void setCurrentProgram(int) override {}
+    const String getProgramName(int) override { return {}; }
+    void changeProgramName(int, const String &) override {}
 
-        printf("Prepare completed\n");
+    void getStateInformation(juce::MemoryBlock &destData) override
+    {
+        MemoryOutputStream(destData, false).writeInt(engineParameter->getIndex());
     }
 
-    void releaseResources() override
+    void setStateInformation(const void *data, int sizeInBytes) override
     {
+        MemoryInputStream state(data, (size_t)sizeInBytes, false);
+        if (sizeInBytes >= 4)
+        {
+            *engineParameter = jlimit(0, engineNames.size() - 1, state.readInt());
+        }
     }
 
-    void processBlock(AudioBuffer<float> &buffer, MidiBuffer &midiMessages) override
+private:
+    void renderBlock(AudioBuffer<float> &buffer, MidiBuffer &midiMessages)
     {
+        const int selectedEngine = engineParameter->getIndex();
+        if (selectedEngine != requestedEngine)
+        {
+            requestedEngine = selectedEngine;
+            reloader.requestReloadFromAudioThread();
+        }
+        swapInReloadedEngine();
+        if (!engine)
+        {
+            buffer.clear();
+            return;
+        }
+        governVoices();
+
         for (const auto metadata : midiMessages)
         {
             MidiMessage message = metadata.getMessage();
             const uint8 *rawmessage = message.getRawData();
-
-            WasmEdge_Value args[3];
-            args[0] = WasmEdge_ValueGenI32((uint8_t)rawmessage[0]); // Replace param1, param2, param3 with actual values
-            args[1] = WasmEdge_ValueGenI32((uint8_t)rawmessage[1]);
-            args[2] = WasmEdge_ValueGenI32((uint8_t)rawmessage[2]);
-            WasmEdge_VMExecute(vm_cxt, WasmEdge_StringCreateByCString("shortmessage"), args, 3, NULL, 0); // Adjust return count as necessary
-
-            printf("sent midi to wasm synth: %d, %d, %d\n", rawmessage[0], rawmessage[1], rawmessage[2]);
+            engine->shortMessage(rawmessage[0], rawmessage[1], rawmessage[2]);
+            if (fadingOut != nullptr)
+            {
+                // so that its note offs arrive while it fades out
+                fadingOut->shortMessage(rawmessage[0], rawmessage[1], rawmessage[2]);
+            }
+            heldNotes.update(rawmessage);
+            governor.noteEvent(rawmessage);
+            rtlog.log("sent midi to wasm synth: %d, %d, %d", rawmessage[0], rawmessage[1], rawmessage[2]);
         }
 
         int numSamples = buffer.getNumSamples();
         auto *left = buffer.getWritePointer(0);
         auto *right = buffer.getWritePointer(1);
 
-        for (int sampleNo = 0; sampleNo < numSamples; sampleNo += 128)
+        const auto renderStart = RenderTelemetry::now();
+        if (!engine->render(left, right, numSamples, 0.3f))
         {
-            int numSamplesToRender = std::min(numSamples - sampleNo, 128);
+            rtlog.log("rendering with engine %d failed", (int)engine->getType());
+        }
+        telemetry.renderFinished(renderStart, numSamples);
 
-            WasmEdge_Value args[1] = {WasmEdge_ValueGenI32((uint32_t)numSamplesToRender)};
-            WasmEdge_Result result = WasmEdge_VMExecute(vm_cxt, fillSampleBufferFuncNameString, args, 1, NULL, 0);
+        if (fadingOut != nullptr && fadePosition < fadeLength)
+        {
+            int numSamplesToFade = jmin(numSamples, fadeLength - fadePosition, fadeBuffer.getNumSamples());
+            float *fadeLeft = fadeBuffer.getWritePointer(0);
+            float *fadeRight = fadeBuffer.getWritePointer(1);
+            fadingOut->render(fadeLeft, fadeRight, numSamplesToFade, 0.3f);
+            crossfade(left, fadeLeft, numSamplesToFade, fadePosition, fadeLength);
+            crossfade(right, fadeRight, numSamplesToFade, fadePosition, fadeLength);
+            // past what fitted into fadeBuffer the old engine is simply gone
+            fadePosition = numSamplesToFade < numSamples ? fadeLength : fadePosition + numSamplesToFade;
+        }
+    }
+
+    static int getDefaultEngine()
+    {
+        String name = SystemStats::getEnvironmentVariable("WASMEDGESYNTH_ENGINE", "aot");
+        return name == "wasm2c" ? SynthEngine::wasm2c : name == "interpreter" ? SynthEngine::wasmEdgeInterpreter : SynthEngine::wasmEdgeAot;
+    }
 
-            for (int ndx = 0; ndx < numSamplesToRender; ndx++)
+    /*
+     * Not on the audio thread. Without compile an AOT engine that is not in the
+     * cache yet is an interpreter engine instead.
+     */
+    std::unique_ptr<SynthEngine> createEngine(SynthEngine::Type type, double sampleRate, bool compile)
+    {
+        std::unique_ptr<SynthEngine> created;
+        if (type == SynthEngine::wasm2c)
+        {
+            // the song that was linked in, a changed song.wasm only reaches the WasmEdge engines
+            created = std::make_unique<Wasm2cEngine>();
+        }
+        else
+        {
+            MemoryBlock wasm;
+            if (!songFile.loadFileAsData(wasm))
+            {
+                printf("Could not read %s\n", songFile.getFullPathName().toRawUTF8());
+                return nullptr;
+            }
+            File aotFile = aotCache.getEntry(wasm);
+            const bool cached = aotCache.lookup(aotFile);
+            if (type == SynthEngine::wasmEdgeAot && !cached && compile)
+            {
+                if (!aotCache.compile(songFile, aotFile))
+                {
+                    printf("AOT compiling %s failed\n", songFile.getFullPathName().toRawUTF8());
+                    return nullptr;
+                }
+                printf("AOT compiled %s\n", aotFile.getFullPathName().toRawUTF8());
+            }
+            if (type == SynthEngine::wasmEdgeAot && (cached || compile))
             {
-                left[sampleNo + ndx] = renderbuf[ndx] * 0.3;
-                right[sampleNo + ndx] = renderbuf[ndx + 128] * 0.3;
+                created = std::make_unique<WasmEdgeEngine>(aotFile.getFullPathName().toStdString(), false);
             }
+            else
+            {
+                created = std::make_unique<WasmEdgeEngine>(songFile.getFullPathName().toStdString(), true);
+            }
+        }
+        if (!created->instantiate((float)sampleRate))
+        {
+            return nullptr;
         }
+        return created;
     }
 
-    using AudioProcessor::processBlock;
+    /* Audio thread: lets the governor shed voices if the last callback came too close to its deadline */
+    void governVoices()
+    {
+        const int numStolen = governor.update(
+            lastCallbackLoad, [this](SynthEngine::Voice *voices, int maxVoices) { return engine->getActiveVoices(voices, maxVoices); },
+            [this](uint8 status, uint8 note, uint8 velocity)
+            {
+                engine->shortMessage(status, note, velocity);
+                // a reloaded engine must not get the note back
+                const uint8 noteOff[3] = {status, note, velocity};
+                heldNotes.update(noteOff);
+            });
+        telemetry.voicesStolen(numStolen);
+    }
 
-    const String getName() const override { return getIdentifier(); }
-    double getTailLengthSeconds() const override { return 0.0; }
-    bool acceptsMidi() const override { return true; }
-    bool producesMidi() const override { return true; }
-    AudioProcessorEditor *createEditor() override { return nullptr; }
-    bool hasEditor() const override { return false; }
-    int getNumPrograms() override { return 1; }
-    int getCurrentProgram() override { return 0; }
-    void setCurrentProgram(int) override {}
-    const String getProgramName(int) override { return {}; }
-    void changeProgramName(int, const String &) override {}
-    void getStateInformation(juce::MemoryBlock &) override {}
-    void setStateInformation(const void *, int) override {}
+    static PolyphonyGovernor<SynthEngine::Voice>::Policy getStealPolicy()
+    {
+        return SystemStats::getEnvironmentVariable("WASMEDGESYNTH_VOICE_STEALING", "oldest") == "quietest"
+                   ? PolyphonyGovernor<SynthEngine::Voice>::quietest
+                   : PolyphonyGovernor<SynthEngine::Voice>::oldest;
+    }
 
-private:
-    WasmEdge_VMContext *vm_cxt;
-    WasmEdge_ModuleInstanceContext *environmentModuleInstanceContext;
-    WasmEdge_String fillSampleBufferFuncNameString;
-    float32_t *renderbuf;
+    void swapInReloadedEngine()
+    {
+        if (fadingOut != nullptr)
+        {
+            // the watcher thread deletes it, the next block tries again if it is still busy
+            if (fadePosition < fadeLength || !reloader.retire(fadingOut))
+            {
+                return;
+            }
+            fadingOut = nullptr;
+        }
+        SynthEngine *reloaded = reloader.takeReloaded();
+        if (reloaded == nullptr)
+        {
+            return;
+        }
+        // the load and the limit were the old engine's, the held notes start over as the new one's
+        governor.reset();
+        heldNotes.forEach([this, reloaded](uint8 status, uint8 note, uint8 velocity)
+                          {
+                              reloaded->shortMessage(status, note, velocity);
+                              const uint8 noteOn[3] = {status, note, velocity};
+                              governor.noteEvent(noteOn);
+                          });
+        fadingOut = engine.release();
+        engine.reset(reloaded);
+        fadePosition = 0;
+        numEnginesReloaded.store(numEnginesReloaded.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        rtlog.log("crossfading to engine %d", (int)engine->getType());
+    }
+
+    /* Watcher thread: the selected engine, with song.wasm AOT compiled unless it is cached */
+    std::unique_ptr<SynthEngine> buildReloadedEngine()
+    {
+        const double sampleRate = preparedSampleRate;
+        if (sampleRate == 0)
+        {
+            return nullptr;
+        }
+        return createEngine((SynthEngine::Type)engineParameter->getIndex(), sampleRate, true);
+    }
+
+    /* Not on the audio thread: moves the engine into the cache for the samplerate it was prepared for */
+    void keepEngine()
+    {
+        // after a reload the cached engines may play the previous song.wasm
+        const uint32 reloads = numEnginesReloaded.load(std::memory_order_acquire);
+        if (reloads != numEnginesReloadedWhenCached)
+        {
+            engineCache.clear();
+            numEnginesReloadedWhenCached = reloads;
+        }
+        engineCache.put(preparedSampleRate, std::move(engine));
+        const int selectedEngine = engineParameter->getIndex();
+        engineCache.retainIf([selectedEngine](const SynthEngine &cached) { return cached.getType() == selectedEngine; });
+        delete fadingOut;
+        fadingOut = nullptr;
+        heldNotes.clear();
+    }
+
+    const StringArray engineNames{"wasm2c", "WasmEdge AOT", "WasmEdge interpreter"};
+    AudioParameterChoice *engineParameter;
+    // the engine the audio thread last asked for, it may still be being built
+    int requestedEngine = 0;
+
+    const File songFile = File::getSpecialLocation(File::userHomeDirectory).getChildFile("song.wasm");
+    AotCache aotCache;
+    std::atomic<double> preparedSampleRate{0};
+
+    // enough for 44.1, 48, 88.2 and 96 kHz
+    EngineCache<SynthEngine> engineCache{4};
+    std::atomic<uint32> numEnginesReloaded{0};
+    uint32 numEnginesReloadedWhenCached = 0;
+    std::unique_ptr<SynthEngine> engine;
+    SynthEngine *fadingOut = nullptr;
+    AudioBuffer<float> fadeBuffer;
+    int fadePosition = 0;
+    int fadeLength = 0;
+    HeldNotes heldNotes;
+
+    RtLog rtlog{"WasmEdgeSynth"};
+    // appended to the file WASMEDGESYNTH_TELEMETRY names every 10 seconds
+    RenderTelemetry telemetry{"WasmEdgeSynth", SystemStats::getEnvironmentVariable("WASMEDGESYNTH_TELEMETRY", {}).toStdString()};
+    // voices are stolen past WASMEDGESYNTH_VOICE_BUDGET (0.75 of the deadline by default, 0 turns it off),
+    // the oldest first or with WASMEDGESYNTH_VOICE_STEALING=quietest the quietest
+    PolyphonyGovernor<SynthEngine::Voice> governor{SystemStats::getEnvironmentVariable("WASMEDGESYNTH_VOICE_BUDGET", "0.75").getDoubleValue(),
+                                                   getStealPolicy()};
+    double lastCallbackLoad = 0;
     Synthesiser synth;
+    // last, so that the watcher thread stops before anything it uses is destroyed.
+    // It builds the AOT module after a cache miss and on engine changes, and watches the song with WASMEDGESYNTH_HOT_RELOAD set
+    HotReloader<SynthEngine> reloader{songFile, SystemStats::getEnvironmentVariable("WASMEDGESYNTH_HOT_RELOAD", {}).isNotEmpty(),
+                                      [this] { return buildReloadedEngine(); }};
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmEdgeSynth)
 };
 